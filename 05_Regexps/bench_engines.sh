@@ -0,0 +1,60 @@
+#!/bin/bash
+# Compare esub's regex engines on representative patterns.
+#
+# Usage: ./bench_engines.sh [LINES]
+#
+# Prints wall time and lines/s per pattern and engine, and checks that both
+# engines produce the same output for the whole match (\0).
+
+set -e
+
+ESUB=${ESUB:-./esub}
+lines=${1:-200000}
+
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+
+# Log-like lines: most patterns below match a fraction of them
+seq 1 "$lines" | awk '{
+    printf "2025-%02d-%02d 12:%02d:%02d host%d sshd[%d]: user%d@example.com from 10.0.%d.%d port %d\n",
+           $1 % 12 + 1, $1 % 28 + 1, $1 % 60, $1 % 60, $1 % 7, $1, $1 % 97, $1 % 256, $1 % 200, $1 % 65536
+}' > "$workdir/log.txt"
+
+# Long runs of 'a': worst case for backtracking-prone matchers
+awk -v n=$((lines / 1000 + 1)) 'BEGIN {
+    line = sprintf("%2000s", ""); gsub(/ /, "a", line)
+    for (i = 0; i < n; i++) print line
+}' > "$workdir/runs.txt"
+
+bench() {
+    local input=$1 pattern=$2
+    local count out_posix out_nfa
+    count=$(wc -l < "$input")
+
+    for engine in posix nfa; do
+        local start=$EPOCHREALTIME
+        "$ESUB" -m "$engine" -f "$input" "$pattern" "<\\0>" > "$workdir/out_$engine.txt"
+        local end=$EPOCHREALTIME
+        awk -v p="$pattern" -v e="$engine" -v s="$start" -v t="$end" -v n="$count" 'BEGIN {
+            d = t - s; if (d <= 0) d = 1e-6
+            printf "%-34s %-6s %8.3f s %12.0f lines/s\n", p, e, d, n / d
+        }'
+    done
+
+    if ! cmp -s "$workdir/out_posix.txt" "$workdir/out_nfa.txt"; then
+        echo "  (engines disagree on this pattern)"
+    fi
+}
+
+echo "Representative patterns ($lines lines):"
+bench "$workdir/log.txt" "user[0-9]+@example\\.com"
+bench "$workdir/log.txt" "([0-9]+)-([0-9]+)-([0-9]+)"
+bench "$workdir/log.txt" "from ([0-9]+\\.){3}[0-9]+"
+bench "$workdir/log.txt" "sshd\\[[0-9]+\\]|port 22$"
+bench "$workdir/log.txt" "([a-z]+)([0-9]+)@([a-z]+)"
+
+echo ""
+echo "Pathological patterns ($(wc -l < "$workdir/runs.txt") lines of 2000 'a'):"
+bench "$workdir/runs.txt" "(a|aa)*b|z"
+bench "$workdir/runs.txt" "(a+a+)+b|z"
+bench "$workdir/runs.txt" "(.*)(.*)(.*)c|z"
@@ -0,0 +1,33 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <regex.h>
+
+// A regex engine compiles an ERE once and then matches it against lines
+// that are not NUL-terminated. Compiled patterns carry scratch state, so
+// each thread must compile its own.
+typedef struct {
+    const char *name;
+
+    // Compile pattern. On success stores the compiled handle and the number
+    // of capture groups and returns 0; otherwise prints a "Regex error:"
+    // diagnostic to stderr and returns -1.
+    int (*compile)(void **handle, const char *pattern, size_t *nsub);
+
+    // Find the leftmost-longest match in text[0..len). Fills nmatch entries
+    // of matches (offsets relative to text, -1 for unset groups). Returns 1
+    // on a match, 0 if there is none and -1 on error.
+    int (*exec)(void *handle, const char *text, size_t len,
+                regmatch_t *matches, size_t nmatch);
+
+    void (*free)(void *handle);
+} regex_engine;
+
+// glibc regcomp/regexec
+extern const regex_engine posix_engine;
+
+// In-tree Pike VM: linear time in the input, no backreferences
+extern const regex_engine nfa_engine;
+
+#endif /* ENGINE_H */
@@ -1,13 +1,24 @@
+#define _GNU_SOURCE  // memmem, memrchr, madvise
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "engine.h"
 
 #define MAX_MATCHES 10  // Capture groups 0-9 (0 is the whole match)
 #define MAX_SUBSTITUTIONS 100
 #define MAX_ERROR_MSG 1024
-#define MAX_RESULT_SIZE 4096
+#define CHUNK_SIZE (4 * 1024 * 1024)  // Unit of work for -f processing
+#define READ_CHUNK_SIZE (64 * 1024)
 
 #define COLOR_RED     "\033[31m"
 #define COLOR_GREEN   "\033[32m"
@@ -34,150 +45,1201 @@ void print_regex_error(int error_code, regex_t *regex) {
     fprintf(stderr, "Regex error: %s\n", error_message);
 }
 
-int process_substitution(const char *substitution, char *result, 
-                         regmatch_t *matches, int nmatch, const char *input, 
-                         bool use_colors) {
-    int result_pos = 0;
-    int subst_pos = 0;
+typedef enum {
+    OP_LITERAL,  // Copy a span of the template pool
+    OP_GROUP,    // Copy a capture group of the current match
+} subst_op_kind;
+
+typedef struct {
+    subst_op_kind kind;
+    int group;
+    size_t offset;
+    size_t len;
+} subst_op;
+
+// Replacement string parsed once into literal spans and group references.
+// Escapes and color codes are already resolved into the pool, so applying
+// the template to a match is a sequence of memcpy calls.
+typedef struct {
+    subst_op *ops;
+    int nops;
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+} subst_template;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} out_buf;
+
+void out_reserve(out_buf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return;
+    }
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    buf->data = data;
+    buf->cap = cap;
+}
+
+void out_append(out_buf *buf, const char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    out_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void out_free(out_buf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+static void template_push_op(subst_template *t, subst_op op) {
+    subst_op *ops = realloc(t->ops, (t->nops + 1) * sizeof(subst_op));
+    if (ops == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    t->ops = ops;
+    t->ops[t->nops++] = op;
+}
+
+static void template_push_literal(subst_template *t, const char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (t->pool_len + len > t->pool_cap) {
+        size_t cap = t->pool_cap ? t->pool_cap : 64;
+        while (cap < t->pool_len + len) {
+            cap *= 2;
+        }
+        char *pool = realloc(t->pool, cap);
+        if (pool == NULL) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        t->pool = pool;
+        t->pool_cap = cap;
+    }
+    memcpy(t->pool + t->pool_len, data, len);
+
+    // Extend the previous literal when it ends right where this one starts
+    subst_op *last = t->nops > 0 ? &t->ops[t->nops - 1] : NULL;
+    if (last && last->kind == OP_LITERAL && last->offset + last->len == t->pool_len) {
+        last->len += len;
+    } else {
+        subst_op op = { OP_LITERAL, 0, t->pool_len, len };
+        template_push_op(t, op);
+    }
+    t->pool_len += len;
+}
+
+void free_substitution(subst_template *t) {
+    free(t->ops);
+    free(t->pool);
+    memset(t, 0, sizeof(*t));
+}
+
+// Parse the replacement string once. nsub is the number of capture groups
+// in the compiled regex, so references to missing groups fail up front.
+int compile_substitution(const char *substitution, size_t nsub, bool use_colors,
+                         subst_template *t) {
+    memset(t, 0, sizeof(*t));
     int ref_count = 0;
-    
-    while (substitution[subst_pos] != '\0' && result_pos < MAX_RESULT_SIZE - 1) {
-        if (substitution[subst_pos] == '\\') {
-            subst_pos++;
-            
-            if (substitution[subst_pos] == '\\') {
-                result[result_pos++] = '\\';
-            } else if (substitution[subst_pos] >= '0' && substitution[subst_pos] <= '9') {
-                int group = substitution[subst_pos] - '0';
-                ref_count++;
-                
-                if (ref_count > MAX_SUBSTITUTIONS) {
-                    fprintf(stderr, "Error: Too many references in substitution string (max %d)\n", 
-                            MAX_SUBSTITUTIONS);
-                    return -1;
-                }
-                
-                if (group >= nmatch || matches[group].rm_so == -1) {
-                    fprintf(stderr, "Error: Reference to non-existent group \\%d\n", group);
-                    return -1;
-                }
-                
-                int match_len = matches[group].rm_eo - matches[group].rm_so;
-                if (result_pos + match_len >= MAX_RESULT_SIZE - 1) {
-                    fprintf(stderr, "Error: Result string too large\n");
-                    return -1;
-                }
-                
-                if (use_colors && group > 0) {
-                    const char *color = colors[(group - 1) % num_colors];
-                    int color_len = strlen(color);
-                    if (result_pos + color_len >= MAX_RESULT_SIZE - 1) {
-                        fprintf(stderr, "Error: Result string too large\n");
-                        return -1;
-                    }
-                    strcpy(result + result_pos, color);
-                    result_pos += color_len;
-                }
-                
-                strncpy(result + result_pos, 
-                        input + matches[group].rm_so, 
-                        match_len);
-                result_pos += match_len;
-                
-                if (use_colors && group > 0) {
-                    int reset_len = strlen(COLOR_RESET);
-                    if (result_pos + reset_len >= MAX_RESULT_SIZE - 1) {
-                        fprintf(stderr, "Error: Result string too large\n");
-                        return -1;
-                    }
-                    strcpy(result + result_pos, COLOR_RESET);
-                    result_pos += reset_len;
+    const char *p = substitution;
+
+    while (*p != '\0') {
+        if (*p != '\\') {
+            size_t span = strcspn(p, "\\");
+            template_push_literal(t, p, span);
+            p += span;
+            continue;
+        }
+
+        p++;
+        if (*p == '\\') {
+            template_push_literal(t, "\\", 1);
+        } else if (*p >= '0' && *p <= '9') {
+            int group = *p - '0';
+            ref_count++;
+
+            if (ref_count > MAX_SUBSTITUTIONS) {
+                fprintf(stderr, "Error: Too many references in substitution string (max %d)\n",
+                        MAX_SUBSTITUTIONS);
+                free_substitution(t);
+                return -1;
+            }
+
+            if ((size_t)group > nsub) {
+                fprintf(stderr, "Error: Reference to non-existent group \\%d\n", group);
+                free_substitution(t);
+                return -1;
+            }
+
+            if (use_colors && group > 0) {
+                const char *color = colors[(group - 1) % num_colors];
+                template_push_literal(t, color, strlen(color));
+            }
+
+            subst_op op = { OP_GROUP, group, 0, 0 };
+            template_push_op(t, op);
+
+            if (use_colors && group > 0) {
+                template_push_literal(t, COLOR_RESET, strlen(COLOR_RESET));
+            }
+        } else if (*p == '\0') {
+            fprintf(stderr, "Warning: Trailing backslash in substitution string\n");
+            template_push_literal(t, "\\", 1);
+            break;
+        } else {
+            fprintf(stderr, "Warning: Unknown escape sequence '\\%c'\n", *p);
+            template_push_literal(t, p - 1, 2);
+        }
+        p++;
+    }
+
+    return 0;
+}
+
+// Append the substitution for one match to out. Groups that did not take
+// part in the match expand to nothing, as in sed.
+void apply_substitution(const subst_template *t, const regmatch_t *matches,
+                        const char *input, out_buf *out) {
+    size_t total = 0;
+    for (int i = 0; i < t->nops; i++) {
+        const subst_op *op = &t->ops[i];
+        if (op->kind == OP_LITERAL) {
+            total += op->len;
+        } else if (matches[op->group].rm_so != -1) {
+            total += matches[op->group].rm_eo - matches[op->group].rm_so;
+        }
+    }
+
+    out_reserve(out, total);
+    char *dst = out->data + out->len;
+    for (int i = 0; i < t->nops; i++) {
+        const subst_op *op = &t->ops[i];
+        if (op->kind == OP_LITERAL) {
+            memcpy(dst, t->pool + op->offset, op->len);
+            dst += op->len;
+        } else if (matches[op->group].rm_so != -1) {
+            size_t len = matches[op->group].rm_eo - matches[op->group].rm_so;
+            memcpy(dst, input + matches[op->group].rm_so, len);
+            dst += len;
+        }
+    }
+    out->len += total;
+}
+
+static int posix_compile(void **handle, const char *pattern, size_t *nsub) {
+    regex_t *regex = malloc(sizeof(regex_t));
+    if (regex == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    int ret = regcomp(regex, pattern, REG_EXTENDED);
+    if (ret != 0) {
+        print_regex_error(ret, regex);
+        regfree(regex);
+        free(regex);
+        return -1;
+    }
+
+    *handle = regex;
+    *nsub = regex->re_nsub;
+    return 0;
+}
+
+static int posix_exec(void *handle, const char *text, size_t len,
+                      regmatch_t *matches, size_t nmatch) {
+    // REG_STARTEND bounds the match to text[0..len) without a terminator
+    matches[0].rm_so = 0;
+    matches[0].rm_eo = len;
+
+    int ret = regexec(handle, text, nmatch, matches, REG_STARTEND);
+    if (ret == REG_NOMATCH) {
+        return 0;
+    } else if (ret != 0) {
+        print_regex_error(ret, handle);
+        return -1;
+    }
+    return 1;
+}
+
+static void posix_free(void *handle) {
+    regfree(handle);
+    free(handle);
+}
+
+const regex_engine posix_engine = {
+    "posix",
+    posix_compile,
+    posix_exec,
+    posix_free,
+};
+
+const regex_engine *engines[] = {
+    &posix_engine,
+    &nfa_engine,
+};
+const int num_engines = sizeof(engines) / sizeof(engines[0]);
+
+// Substitute the first match in line[0..len) and append the result to out.
+// The line does not need to be NUL-terminated. Returns 1 if the pattern
+// matched, 0 if it did not (nothing is appended) and -1 on error.
+int substitute_line(const regex_engine *engine, void *regex, const subst_template *subst,
+                    const char *line, size_t len, out_buf *out) {
+    regmatch_t matches[MAX_MATCHES];
+    int ret = engine->exec(regex, line, len, matches, MAX_MATCHES);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    out_append(out, line, matches[0].rm_so);
+    apply_substitution(subst, matches, line, out);
+    out_append(out, line + matches[0].rm_eo, len - matches[0].rm_eo);
+    return 1;
+}
+
+typedef struct {
+    char *pattern;
+    subst_template subst;
+    char *literal;  // Substring every match contains, NULL if unknown
+    size_t literal_len;
+} esub_rule;
+
+// Shared, read-only description of the substitutions to run, in order.
+typedef struct {
+    const regex_engine *engine;
+    esub_rule *rules;
+    int nrules;
+} esub_job;
+
+// Per-thread matching state. Each thread compiles its own patterns: glibc
+// regexec serializes on a shared regex_t and the NFA engine keeps scratch
+// space in its compiled form.
+typedef struct {
+    void **regexes;
+    out_buf scratch[2];
+} matcher;
+
+typedef struct {
+    size_t lines;
+    size_t skipped;  // Lines rejected by the literal prefilter
+} esub_stats;
+
+// Parse the quantifier following an atom, if any. Returns the number of
+// pattern bytes it spans and sets *optional when it allows zero repeats.
+static size_t parse_quantifier(const char *p, bool *optional) {
+    *optional = false;
+    const char *start = p;
+    while (*p == '*' || *p == '?' || *p == '+' || *p == '{') {
+        if (*p == '*' || *p == '?') {
+            *optional = true;
+            p++;
+        } else if (*p == '+') {
+            p++;
+        } else {
+            const char *close = strchr(p, '}');
+            if (close == NULL) {
+                break;
+            }
+            if (atoi(p + 1) == 0) {
+                *optional = true;
+            }
+            p = close + 1;
+        }
+    }
+    return p - start;
+}
+
+// Skip a bracket expression starting at '['. Returns a pointer past ']'.
+static const char *skip_bracket(const char *p) {
+    p++;
+    if (*p == '^') {
+        p++;
+    }
+    if (*p == ']') {
+        p++;
+    }
+    while (*p != '\0' && *p != ']') {
+        if (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            const char *close = strstr(p + 2, (char[]){ p[1], ']', '\0' });
+            p = close ? close + 2 : p + 1;
+        } else {
+            p++;
+        }
+    }
+    return *p == ']' ? p + 1 : p;
+}
+
+// Find the longest run of literal characters that every match of an ERE
+// must contain. Alternation at the top level defeats this (any branch may
+// match), and groups are treated as opaque. Returns the literal length;
+// the literal itself is written to out, which must hold strlen(pattern)
+// bytes.
+size_t extract_required_literal(const char *pattern, char *out) {
+    size_t best_len = 0;
+    size_t run_len = 0;
+    int depth = 0;
+
+    // Reject top-level alternation up front
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '[') {
+            p = skip_bracket(p) - 1;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            depth--;
+        } else if (*p == '|' && depth == 0) {
+            return 0;
+        }
+    }
+
+    char *run = malloc(strlen(pattern) + 1);
+    if (run == NULL) {
+        return 0;
+    }
+
+    const char *p = pattern;
+    while (*p != '\0') {
+        int literal = -1;
+
+        if (*p == '\\') {
+            if (p[1] != '\0' && strchr(".[]()*+?{}|^$\\", p[1]) != NULL) {
+                literal = (unsigned char)p[1];
+            }
+            p += p[1] != '\0' ? 2 : 1;
+        } else if (*p == '[') {
+            p = skip_bracket(p);
+        } else if (*p == '(') {
+            for (depth = 0; *p != '\0'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == '[') {
+                    p = skip_bracket(p) - 1;
+                } else if (*p == '(') {
+                    depth++;
+                } else if (*p == ')' && --depth == 0) {
+                    p++;
+                    break;
                 }
-            } else {
-                fprintf(stderr, "Warning: Unknown escape sequence '\\%c'\n", substitution[subst_pos]);
-                result[result_pos++] = '\\';
-                result[result_pos++] = substitution[subst_pos];
             }
+        } else if (*p == '.' || *p == '^' || *p == '$' || *p == '\n') {
+            p++;
         } else {
-            result[result_pos++] = substitution[subst_pos];
+            literal = (unsigned char)*p++;
+        }
+
+        bool optional;
+        size_t qlen = parse_quantifier(p, &optional);
+        p += qlen;
+
+        if (literal != -1 && !optional) {
+            run[run_len++] = (char)literal;
+        }
+        // Anything but a plain, unrepeated literal ends the current run
+        if (literal == -1 || qlen > 0) {
+            if (run_len > best_len) {
+                memcpy(out, run, run_len);
+                best_len = run_len;
+            }
+            run_len = 0;
+        }
+    }
+    if (run_len > best_len) {
+        memcpy(out, run, run_len);
+        best_len = run_len;
+    }
+    free(run);
+    return best_len;
+}
+
+int matcher_init(matcher *m, const esub_job *job) {
+    memset(m, 0, sizeof(*m));
+    m->regexes = calloc(job->nrules, sizeof(void *));
+    if (m->regexes == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    for (int i = 0; i < job->nrules; i++) {
+        size_t nsub;
+        if (job->engine->compile(&m->regexes[i], job->rules[i].pattern, &nsub) != 0) {
+            while (i-- > 0) {
+                job->engine->free(m->regexes[i]);
+            }
+            free(m->regexes);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void matcher_free(matcher *m, const esub_job *job) {
+    for (int i = 0; i < job->nrules; i++) {
+        job->engine->free(m->regexes[i]);
+    }
+    free(m->regexes);
+    out_free(&m->scratch[0]);
+    out_free(&m->scratch[1]);
+}
+
+// Apply every rule in order to one line (without its newline), each rule
+// seeing the output of the previous one, and append the result to out.
+// Intermediate results ping-pong between the matcher's scratch buffers.
+// Returns the number of rules the prefilter let through, or -1 on error.
+int substitute_rules(const esub_job *job, matcher *m,
+                     const char *line, size_t len, out_buf *out) {
+    const char *text = line;
+    size_t text_len = len;
+    int candidates = 0;
+    int which = 0;
+
+    for (int i = 0; i < job->nrules; i++) {
+        const esub_rule *rule = &job->rules[i];
+        if (rule->literal != NULL
+                && memmem(text, text_len, rule->literal, rule->literal_len) == NULL) {
+            continue;
+        }
+        candidates++;
+
+        out_buf *dst = &m->scratch[which];
+        dst->len = 0;
+        int ret = substitute_line(job->engine, m->regexes[i], &rule->subst, text, text_len, dst);
+        if (ret < 0) {
+            return -1;
+        } else if (ret > 0) {
+            text = dst->data;
+            text_len = dst->len;
+            which ^= 1;
+        }
+    }
+
+    out_append(out, text, text_len);
+    return candidates;
+}
+
+// Run the job over every line of data[0..len), keeping newlines. With a
+// single rule that has a required literal, lines without it are copied
+// through in bulk: one memmem finds the next candidate line.
+int process_lines(const esub_job *job, matcher *m,
+                  const char *data, size_t len, out_buf *out, esub_stats *stats) {
+    const esub_rule *only = job->nrules == 1 ? &job->rules[0] : NULL;
+    const char *end = data + len;
+
+    while (data < end) {
+        if (only != NULL && only->literal != NULL) {
+            const char *hit = memmem(data, end - data, only->literal, only->literal_len);
+            const char *line_start = end;
+            if (hit != NULL) {
+                const char *nl = memrchr(data, '\n', hit - data);
+                line_start = nl ? nl + 1 : data;
+            }
+
+            for (const char *p = data; p < line_start; ) {
+                const char *nl = memchr(p, '\n', line_start - p);
+                stats->lines++;
+                stats->skipped++;
+                p = nl ? nl + 1 : line_start;
+            }
+            out_append(out, data, line_start - data);
+            data = line_start;
+            if (hit == NULL) {
+                break;
+            }
+        }
+
+        const char *nl = memchr(data, '\n', end - data);
+        size_t line_len = nl ? (size_t)(nl - data) : (size_t)(end - data);
+
+        int candidates = substitute_rules(job, m, data, line_len, out);
+        if (candidates < 0) {
+            return -1;
+        } else if (candidates == 0) {
+            stats->skipped++;
+        }
+        if (nl) {
+            out_append(out, "\n", 1);
+        }
+        stats->lines++;
+        data += line_len + (nl != NULL);
+    }
+    return 0;
+}
+
+int write_all(int fd, const out_buf *out) {
+    const char *p = out->data;
+    size_t left = out->len;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Failed to write output - %s\n", strerror(errno));
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return 0;
+}
+
+// Input mapped (or, for pipes, read) into memory.
+typedef struct {
+    char *data;
+    size_t len;
+    bool mapped;
+} input_file;
+
+int load_input(const char *path, input_file *in) {
+    memset(in, 0, sizeof(*in));
+
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Cannot open %s - %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            in->data = data;
+            in->len = st.st_size;
+            in->mapped = true;
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            return 0;
+        }
+    }
+
+    // Not mappable: slurp it
+    out_buf buf = {0};
+    for (;;) {
+        out_reserve(&buf, READ_CHUNK_SIZE);
+        ssize_t n = read(fd, buf.data + buf.len, READ_CHUNK_SIZE);
+        if (n == 0) {
+            break;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Cannot read %s - %s\n", path, strerror(errno));
+            out_free(&buf);
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            return -1;
+        }
+        buf.len += n;
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    in->data = buf.data;
+    in->len = buf.len;
+    return 0;
+}
+
+void free_input(input_file *in) {
+    if (in->mapped) {
+        munmap(in->data, in->len);
+    } else {
+        free(in->data);
+    }
+    memset(in, 0, sizeof(*in));
+}
+
+typedef struct {
+    const char *data;
+    size_t len;
+    out_buf out;
+    esub_stats stats;
+    int status;  // 0 pending, 1 done, -1 failed
+} chunk;
+
+// Chunks are handed to workers in order; at most `window` of them may be
+// processed but not yet written, which bounds memory on huge inputs.
+typedef struct {
+    const esub_job *job;
+    chunk *chunks;
+    int nchunks;
+    int next;
+    int written;
+    int window;
+    bool abort;
+    pthread_mutex_t lock;
+    pthread_cond_t chunk_done;
+    pthread_cond_t slot_free;
+} chunk_queue;
+
+void *chunk_worker(void *arg) {
+    chunk_queue *q = arg;
+
+    matcher m;
+    if (matcher_init(&m, q->job) != 0) {
+        pthread_mutex_lock(&q->lock);
+        q->abort = true;
+        pthread_cond_broadcast(&q->chunk_done);
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->abort && q->next < q->nchunks && q->next >= q->written + q->window) {
+            pthread_cond_wait(&q->slot_free, &q->lock);
+        }
+        if (q->abort || q->next >= q->nchunks) {
+            break;
+        }
+        chunk *c = &q->chunks[q->next++];
+        pthread_mutex_unlock(&q->lock);
+
+        int status = process_lines(q->job, &m, c->data, c->len, &c->out, &c->stats) == 0 ? 1 : -1;
+
+        pthread_mutex_lock(&q->lock);
+        c->status = status;
+        pthread_cond_broadcast(&q->chunk_done);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    matcher_free(&m, q->job);
+    return NULL;
+}
+
+// End of the chunk starting at pos: chunk_size bytes, extended to the next
+// newline so no line is split between chunks.
+size_t chunk_end(const char *data, size_t len, size_t pos, size_t chunk_size) {
+    if (len - pos <= chunk_size) {
+        return len;
+    }
+    const char *nl = memchr(data + pos + chunk_size, '\n', len - pos - chunk_size);
+    return nl ? (size_t)(nl - data) + 1 : len;
+}
+
+// Split data into newline-aligned chunks of roughly chunk_size bytes.
+int split_chunks(const char *data, size_t len, size_t chunk_size, chunk **out) {
+    int count = 0;
+    int cap = 0;
+    chunk *chunks = NULL;
+
+    size_t pos = 0;
+    while (pos < len) {
+        size_t end = chunk_end(data, len, pos, chunk_size);
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            chunk *grown = realloc(chunks, cap * sizeof(chunk));
+            if (grown == NULL) {
+                fprintf(stderr, "Error: Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            chunks = grown;
+        }
+        memset(&chunks[count], 0, sizeof(chunk));
+        chunks[count].data = data + pos;
+        chunks[count].len = end - pos;
+        count++;
+        pos = end;
+    }
+
+    *out = chunks;
+    return count;
+}
+
+int process_sequential(const esub_job *job, matcher *m,
+                       const char *data, size_t len, int fd, esub_stats *stats) {
+    out_buf out = {0};
+    size_t pos = 0;
+    int result = 0;
+
+    // Flush roughly every CHUNK_SIZE bytes instead of buffering the whole file
+    while (pos < len && result == 0) {
+        size_t end = chunk_end(data, len, pos, CHUNK_SIZE);
+
+        out.len = 0;
+        if (process_lines(job, m, data + pos, end - pos, &out, stats) != 0
+                || write_all(fd, &out) != 0) {
+            result = -1;
+        }
+        pos = end;
+    }
+
+    out_free(&out);
+    return result;
+}
+
+int process_parallel(const esub_job *job, matcher *m, const char *data, size_t len,
+                     int nthreads, int fd, esub_stats *stats) {
+    chunk_queue q;
+    memset(&q, 0, sizeof(q));
+    q.job = job;
+    q.nchunks = split_chunks(data, len, CHUNK_SIZE, &q.chunks);
+    q.window = nthreads * 2;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.chunk_done, NULL);
+    pthread_cond_init(&q.slot_free, NULL);
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+    for (; threads != NULL && started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, chunk_worker, &q) != 0) {
+            break;
+        }
+    }
+
+    // Could not spawn anything: do the work here. No chunk has been
+    // handed out, so the queue is dropped as it is.
+    int result = 0;
+    if (started == 0) {
+        result = process_sequential(job, m, data, len, fd, stats);
+    }
+
+    // Write chunks back in input order as they complete
+    for (int i = 0; i < q.nchunks && started > 0 && result == 0; i++) {
+        chunk *c = &q.chunks[i];
+
+        pthread_mutex_lock(&q.lock);
+        while (c->status == 0 && !q.abort) {
+            pthread_cond_wait(&q.chunk_done, &q.lock);
+        }
+        int status = c->status;
+        pthread_mutex_unlock(&q.lock);
+
+        if (status != 1 || write_all(fd, &c->out) != 0) {
+            result = -1;
+        }
+        out_free(&c->out);
+        stats->lines += c->stats.lines;
+        stats->skipped += c->stats.skipped;
+
+        pthread_mutex_lock(&q.lock);
+        q.written++;
+        if (result != 0) {
+            q.abort = true;
+        }
+        pthread_cond_broadcast(&q.slot_free);
+        pthread_mutex_unlock(&q.lock);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < q.nchunks; i++) {
+        out_free(&q.chunks[i].out);
+    }
+
+    free(threads);
+    free(q.chunks);
+    pthread_cond_destroy(&q.slot_free);
+    pthread_cond_destroy(&q.chunk_done);
+    pthread_mutex_destroy(&q.lock);
+    return result;
+}
+
+int process_input(const esub_job *job, matcher *m, const input_file *in,
+                  int nthreads, int fd, esub_stats *stats) {
+    if (nthreads > 1 && in->len > CHUNK_SIZE) {
+        return process_parallel(job, m, in->data, in->len, nthreads, fd, stats);
+    }
+    return process_sequential(job, m, in->data, in->len, fd, stats);
+}
+
+// Rewrite path in place. Output is streamed in CHUNK_SIZE writes into a
+// temporary file in the same directory, synced, and renamed over the
+// original, so readers see either the old or the new contents.
+int rewrite_file(const esub_job *job, matcher *m, const char *path,
+                 int nthreads, esub_stats *stats) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "Error: Cannot stat %s - %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: %s is not a regular file\n", path);
+        return -1;
+    }
+
+    input_file in;
+    if (load_input(path, &in) != 0) {
+        return -1;
+    }
+
+    size_t tmp_len = strlen(path) + sizeof(".esubXXXXXX");
+    char *tmp_path = malloc(tmp_len);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free_input(&in);
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.esubXXXXXX", path);
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Cannot create temporary file for %s - %s\n", path, strerror(errno));
+        free(tmp_path);
+        free_input(&in);
+        return -1;
+    }
+
+    // Keep the original owner when we may, and the permissions
+    mode_t mode = st.st_mode & 07777;
+    if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+        mode &= 0777;  // No set-id bits on a file with a different owner
+    }
+    int result = fchmod(fd, mode);
+    if (result != 0) {
+        fprintf(stderr, "Error: Cannot set mode of %s - %s\n", tmp_path, strerror(errno));
+    } else {
+        result = process_input(job, m, &in, nthreads, fd, stats);
+    }
+    free_input(&in);
+
+    if (result == 0 && fsync(fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync %s - %s\n", tmp_path, strerror(errno));
+        result = -1;
+    }
+    if (close(fd) != 0 && result == 0) {
+        fprintf(stderr, "Error: Cannot close %s - %s\n", tmp_path, strerror(errno));
+        result = -1;
+    }
+    if (result == 0 && rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Error: Cannot replace %s - %s\n", path, strerror(errno));
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    return result;
+}
+
+// Files for -i are handed out to workers one at a time.
+typedef struct {
+    const esub_job *job;
+    char **paths;
+    int npaths;
+    int next;
+    int failed;
+    esub_stats stats;
+    pthread_mutex_t lock;
+} file_queue;
+
+void *file_worker(void *arg) {
+    file_queue *q = arg;
+
+    matcher m;
+    if (matcher_init(&m, q->job) != 0) {
+        pthread_mutex_lock(&q->lock);
+        q->failed++;
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        int i = q->next < q->npaths ? q->next++ : -1;
+        pthread_mutex_unlock(&q->lock);
+        if (i < 0) {
+            break;
+        }
+
+        esub_stats stats = {0};
+        int result = rewrite_file(q->job, &m, q->paths[i], 1, &stats);
+
+        pthread_mutex_lock(&q->lock);
+        q->stats.lines += stats.lines;
+        q->stats.skipped += stats.skipped;
+        if (result != 0) {
+            q->failed++;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    matcher_free(&m, q->job);
+    return NULL;
+}
+
+// Rewrite every path in place. A single file gets all threads for its
+// chunks; several files are rewritten in parallel, one per thread.
+int rewrite_files(const esub_job *job, matcher *m, char **paths, int npaths,
+                  int nthreads, esub_stats *stats) {
+    if (npaths == 1 || nthreads <= 1) {
+        int result = 0;
+        for (int i = 0; i < npaths; i++) {
+            if (rewrite_file(job, m, paths[i], nthreads, stats) != 0) {
+                result = -1;
+            }
+        }
+        return result;
+    }
+
+    file_queue q;
+    memset(&q, 0, sizeof(q));
+    q.job = job;
+    q.paths = paths;
+    q.npaths = npaths;
+    pthread_mutex_init(&q.lock, NULL);
+
+    if (nthreads > npaths) {
+        nthreads = npaths;
+    }
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+    for (; threads != NULL && started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, file_worker, &q) != 0) {
+            break;
         }
-        
-        subst_pos++;
     }
-    
-    result[result_pos] = '\0';
+    if (started == 0) {
+        // Could not spawn anything: do the work here
+        file_worker(&q);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&q.lock);
+    stats->lines += q.stats.lines;
+    stats->skipped += q.stats.skipped;
+    return q.failed == 0 && q.next == npaths ? 0 : -1;
+}
+
+// Validate a pattern/replacement pair and append it to the job.
+int add_rule(esub_job *job, const char *pattern, const char *substitution, bool use_colors) {
+    void *regex;
+    size_t nsub;
+    if (job->engine->compile(&regex, pattern, &nsub) != 0) {
+        return -1;
+    }
+    job->engine->free(regex);
+
+    esub_rule rule;
+    memset(&rule, 0, sizeof(rule));
+    if (compile_substitution(substitution, nsub, use_colors, &rule.subst) != 0) {
+        return -1;
+    }
+
+    rule.pattern = strdup(pattern);
+    rule.literal = malloc(strlen(pattern) + 1);
+    rule.literal_len = extract_required_literal(pattern, rule.literal);
+    if (rule.literal_len == 0) {
+        free(rule.literal);
+        rule.literal = NULL;
+    }
+
+    esub_rule *rules = realloc(job->rules, (job->nrules + 1) * sizeof(esub_rule));
+    if (rules == NULL || rule.pattern == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    job->rules = rules;
+    job->rules[job->nrules++] = rule;
     return 0;
 }
 
+void free_job(esub_job *job) {
+    for (int i = 0; i < job->nrules; i++) {
+        free(job->rules[i].pattern);
+        free(job->rules[i].literal);
+        free_substitution(&job->rules[i].subst);
+    }
+    free(job->rules);
+    memset(job, 0, sizeof(*job));
+}
+
+// Load a rules file: one "regexp<TAB>substitution" pair per line, applied
+// in file order. Blank lines and lines starting with '#' are ignored.
+int load_rules(const char *path, esub_job *job, bool use_colors) {
+    input_file in;
+    if (load_input(path, &in) != 0) {
+        return -1;
+    }
+
+    int result = 0;
+    int lineno = 0;
+    const char *p = in.data;
+    const char *end = in.data + in.len;
+    while (p < end && result == 0) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        lineno++;
+
+        if (len > 0 && p[0] != '#') {
+            char *line = strndup(p, len);
+            char *tab = line ? strchr(line, '\t') : NULL;
+            if (tab == NULL) {
+                fprintf(stderr, "Error: %s:%d: Expected regexp<TAB>substitution\n", path, lineno);
+                result = -1;
+            } else {
+                *tab = '\0';
+                if (add_rule(job, line, tab + 1, use_colors) != 0) {
+                    fprintf(stderr, "Error: %s:%d: Invalid rule\n", path, lineno);
+                    result = -1;
+                }
+            }
+            free(line);
+        }
+        p += len + (nl != NULL);
+    }
+
+    if (result == 0 && job->nrules == 0) {
+        fprintf(stderr, "Error: %s: No rules\n", path);
+        result = -1;
+    }
+    free_input(&in);
+    return result;
+}
+
 void print_usage(const char *program_name) {
     fprintf(stderr, "Usage: %s [-c] regexp substitution string\n", program_name);
-    fprintf(stderr, "  -c    Enable colored output for capture groups\n");
+    fprintf(stderr, "       %s [-c] -r rules string\n", program_name);
+    fprintf(stderr, "       %s [-c] [-s] [-j threads] [-m engine] -f file regexp substitution\n", program_name);
+    fprintf(stderr, "       %s [-c] [-s] [-j threads] [-m engine] -f file -r rules\n", program_name);
+    fprintf(stderr, "       %s [-c] [-s] [-j threads] [-m engine] -i regexp substitution file...\n", program_name);
+    fprintf(stderr, "       %s [-c] [-s] [-j threads] [-m engine] -i -r rules file...\n", program_name);
+    fprintf(stderr, "  -c          Enable colored output for capture groups\n");
+    fprintf(stderr, "  -f file     Substitute in every line of file ('-' for stdin)\n");
+    fprintf(stderr, "  -i          Rewrite the given files in place\n");
+    fprintf(stderr, "  -j threads  Process file chunks, or -i files, on this many threads (0 = all CPUs)\n");
+    fprintf(stderr, "  -m engine   Regex engine: posix (default) or nfa (linear time,\n");
+    fprintf(stderr, "              repetition counts up to 255)\n");
+    fprintf(stderr, "  -r rules    Apply every regexp<TAB>substitution line of rules in turn\n");
+    fprintf(stderr, "  -s          Print line and prefilter statistics to stderr\n");
 }
 
 int main(int argc, char *argv[]) {
     bool use_colors = false;
-    int arg_offset = 0;
-    
-    // Check for color option
-    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
-        use_colors = true;
-        arg_offset = 1;
-    }
-    
-    if (argc != 4 + arg_offset) {
+    bool show_stats = false;
+    bool in_place = false;
+    const char *input_path = NULL;
+    const char *rules_path = NULL;
+    const regex_engine *engine = &posix_engine;
+    int nthreads = 1;
+    int opt;
+
+    // Stop at the first non-option so patterns may start with '-'
+    while ((opt = getopt(argc, argv, "+cf:ij:m:r:s")) != -1) {
+        switch (opt) {
+        case 'c':
+            use_colors = true;
+            break;
+        case 'f':
+            input_path = optarg;
+            break;
+        case 'i':
+            in_place = true;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads <= 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = cpus > 0 ? (int)cpus : 1;
+            }
+            break;
+        case 'm':
+            engine = NULL;
+            for (int i = 0; i < num_engines; i++) {
+                if (strcmp(optarg, engines[i]->name) == 0) {
+                    engine = engines[i];
+                }
+            }
+            if (engine == NULL) {
+                fprintf(stderr, "Error: Unknown regex engine '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            rules_path = optarg;
+            break;
+        case 's':
+            show_stats = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int nargs = (rules_path ? 0 : 2) + (input_path ? 0 : 1);
+    if (in_place ? (input_path != NULL || argc - optind < nargs) : argc - optind != nargs) {
         print_usage(argv[0]);
         return EXIT_FAILURE;
     }
-    
-    const char *pattern = argv[1 + arg_offset];
-    const char *substitution = argv[2 + arg_offset];
-    const char *input = argv[3 + arg_offset];
-    
-    regex_t regex;
-    int ret;
-    
-    ret = regcomp(&regex, pattern, REG_EXTENDED);
-    if (ret != 0) {
-        print_regex_error(ret, &regex);
-        regfree(&regex);
+
+    esub_job job = { engine, NULL, 0 };
+    if (rules_path != NULL) {
+        if (load_rules(rules_path, &job, use_colors) != 0) {
+            free_job(&job);
+            return EXIT_FAILURE;
+        }
+    } else if (add_rule(&job, argv[optind], argv[optind + 1], use_colors) != 0) {
+        free_job(&job);
         return EXIT_FAILURE;
     }
-    
-    regmatch_t matches[MAX_MATCHES];
-    ret = regexec(&regex, input, MAX_MATCHES, matches, 0);
-    
-    if (ret == REG_NOMATCH) {
-        printf("%s\n", input);
-        regfree(&regex);
-        return EXIT_SUCCESS;
-    } else if (ret != 0) {
-        print_regex_error(ret, &regex);
-        regfree(&regex);
+
+    matcher m;
+    if (matcher_init(&m, &job) != 0) {
+        free_job(&job);
         return EXIT_FAILURE;
     }
-    
-    char result[MAX_RESULT_SIZE] = {0};
-    int result_len = 0;
-    
-    int prefix_len = matches[0].rm_so;
-    if (prefix_len > 0) {
-        strncpy(result, input, prefix_len);
-        result_len = prefix_len;
-    }
-    
-    char substituted[MAX_RESULT_SIZE] = {0};
-    if (process_substitution(substitution, substituted, matches, MAX_MATCHES, input, use_colors) != 0) {
-        regfree(&regex);
-        return EXIT_FAILURE;
+
+    int result;
+    esub_stats stats = {0};
+    if (in_place) {
+        int first = optind + nargs - 1;
+        result = rewrite_files(&job, &m, argv + first, argc - first, nthreads, &stats);
+    } else if (input_path == NULL) {
+        const char *input = argv[argc - 1];
+        out_buf out = {0};
+        result = substitute_rules(&job, &m, input, strlen(input), &out) < 0 ? -1 : 0;
+        if (result == 0) {
+            out_append(&out, "\n", 1);
+            result = write_all(STDOUT_FILENO, &out);
+        }
+        out_free(&out);
+    } else {
+        input_file in;
+        result = load_input(input_path, &in);
+        if (result == 0) {
+            result = process_input(&job, &m, &in, nthreads, STDOUT_FILENO, &stats);
+            free_input(&in);
+        }
     }
-    
-    strcpy(result + result_len, substituted);
-    result_len += strlen(substituted);
-    
-    strcpy(result + result_len, input + matches[0].rm_eo);
-    
-    printf("%s\n", result);
-    
-    regfree(&regex);
-    return EXIT_SUCCESS;
+
+    if (show_stats && (in_place || input_path != NULL)) {
+        fprintf(stderr, "esub: %zu lines, %zu skipped by prefilter\n", stats.lines, stats.skipped);
+        for (int i = 0; i < job.nrules; i++) {
+            if (job.rules[i].literal != NULL) {
+                fprintf(stderr, "esub: rule %d literal \"%.*s\"\n", i + 1,
+                        (int)job.rules[i].literal_len, job.rules[i].literal);
+            }
+        }
+    }
+
+    matcher_free(&m, &job);
+    free_job(&job);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,749 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "engine.h"
+
+// Pike VM for the ERE subset esub needs: literals, '.', bracket expressions
+// (ranges, negation, [:class:]), anchors, groups, alternation and the
+// * + ? {m,n} quantifiers, with counts up to NFA_DUP_MAX rather than glibc's
+// RE_DUP_MAX. All threads advance through the input in lock step, so
+// matching is O(input * program) with no backtracking.
+//
+// The overall match is POSIX leftmost-longest. When several paths give the
+// same overall match, submatches follow the first alternative in pattern
+// order (as in Perl), which can differ from glibc for ambiguous patterns
+// such as (a|ab)(c|bcd).
+
+#define NFA_MAX_GROUPS 10  // Groups 0-9 are recorded
+#define NFA_SLOTS (2 * NFA_MAX_GROUPS)
+#define NFA_MAX_PROGRAM 65536
+#define NFA_DUP_MAX 255
+
+typedef enum {
+    N_EMPTY,
+    N_CHAR,
+    N_ANY,
+    N_CLASS,
+    N_BOL,
+    N_EOL,
+    N_CAT,
+    N_ALT,
+    N_GROUP,
+    N_REPEAT,
+} node_kind;
+
+typedef struct {
+    node_kind kind;
+    int a, b;      // Children of CAT/ALT, body of GROUP/REPEAT
+    int value;     // Character, class index or group number
+    int min, max;  // REPEAT bounds, max -1 for unbounded
+} node;
+
+typedef enum {
+    I_CHAR,
+    I_ANY,
+    I_CLASS,
+    I_BOL,
+    I_EOL,
+    I_SPLIT,  // Fork to x (preferred) and y
+    I_JMP,
+    I_SAVE,   // Record the position in capture slot x
+    I_MATCH,
+} op_code;
+
+typedef struct {
+    op_code op;
+    int x, y;
+} inst;
+
+typedef struct {
+    uint8_t bits[32];
+} char_class;
+
+typedef struct {
+    const char *p;
+    node *nodes;
+    int nnodes;
+    char_class *classes;
+    int nclasses;
+    int ngroups;
+    inst *prog;
+    int len;
+    const char *error;
+} compiler;
+
+typedef struct {
+    int n;
+    int *pc;
+    regoff_t *caps;  // nslots per thread
+} thread_list;
+
+// Pending work for add_thread: follow pc, or restore a capture slot once
+// everything reachable with the new value has been explored.
+typedef struct {
+    int pc;
+    int slot;  // >= 0 for a restore entry
+    regoff_t old;
+} frame;
+
+typedef struct {
+    inst *prog;
+    int len;
+    char_class *classes;
+    int first_char;  // Byte every match starts with, or -1
+    int nslots;      // Capture slots in use, at most NFA_SLOTS
+
+    // Matching scratch, reused across calls
+    thread_list lists[2];
+    unsigned *mark;
+    unsigned gen;
+    frame *stack;
+} nfa;
+
+static void class_set(char_class *cc, int c) {
+    cc->bits[c >> 3] |= 1u << (c & 7);
+}
+
+static bool class_has(const char_class *cc, int c) {
+    return cc->bits[c >> 3] & (1u << (c & 7));
+}
+
+static void *grow(void *ptr, int count, size_t size, compiler *c) {
+    // Capacity starts at 16 and doubles whenever count reaches it
+    if (count != 0 && (count < 16 || (count & (count - 1)) != 0)) {
+        return ptr;
+    }
+    void *grown = realloc(ptr, (count ? count * 2 : 16) * size);
+    if (grown == NULL) {
+        c->error = "Out of memory";
+        return ptr;
+    }
+    return grown;
+}
+
+static int new_node(compiler *c, node_kind kind) {
+    c->nodes = grow(c->nodes, c->nnodes, sizeof(node), c);
+    if (c->error) {
+        return -1;
+    }
+    node *n = &c->nodes[c->nnodes];
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    return c->nnodes++;
+}
+
+static int new_binary(compiler *c, node_kind kind, int a, int b) {
+    int n = new_node(c, kind);
+    if (n >= 0) {
+        c->nodes[n].a = a;
+        c->nodes[n].b = b;
+    }
+    return n;
+}
+
+static int parse_alt(compiler *c);
+
+static bool named_class(char_class *cc, const char *name, size_t len) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } names[] = {
+        { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+        { "upper", isupper }, { "lower", islower }, { "space", isspace },
+        { "blank", isblank }, { "punct", ispunct }, { "print", isprint },
+        { "graph", isgraph }, { "cntrl", iscntrl }, { "xdigit", isxdigit },
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == len && strncmp(names[i].name, name, len) == 0) {
+            for (int ch = 0; ch < 256; ch++) {
+                if (names[i].test(ch)) {
+                    class_set(cc, ch);
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parse one bracket element: a plain byte or a [.x.] / [=x=] form.
+static int bracket_char(compiler *c) {
+    const char *p = c->p;
+    if (p[0] == '[' && (p[1] == '.' || p[1] == '=')) {
+        if (p[2] == '\0' || p[3] != p[1] || p[4] != ']') {
+            c->error = "Invalid collation character";
+            return -1;
+        }
+        c->p += 5;
+        return (unsigned char)p[2];
+    }
+    c->p++;
+    return (unsigned char)p[0];
+}
+
+static int parse_bracket(compiler *c) {
+    char_class cc;
+    memset(&cc, 0, sizeof(cc));
+
+    c->p++;
+    bool negate = *c->p == '^';
+    if (negate) {
+        c->p++;
+    }
+
+    bool first = true;
+    while (first || *c->p != ']') {
+        first = false;
+        if (*c->p == '\0') {
+            c->error = "Unmatched [, [^, [:, [., or [=";
+            return -1;
+        }
+
+        if (c->p[0] == '[' && c->p[1] == ':') {
+            const char *name = c->p + 2;
+            const char *close = strstr(name, ":]");
+            if (close == NULL) {
+                c->error = "Unmatched [, [^, [:, [., or [=";
+                return -1;
+            }
+            if (!named_class(&cc, name, close - name)) {
+                c->error = "Invalid character class name";
+                return -1;
+            }
+            c->p = close + 2;
+            continue;
+        }
+
+        int lo = bracket_char(c);
+        if (lo < 0) {
+            return -1;
+        }
+        int hi = lo;
+        if (c->p[0] == '-' && c->p[1] != ']' && c->p[1] != '\0') {
+            c->p++;
+            hi = bracket_char(c);
+            if (hi < 0) {
+                return -1;
+            }
+            if (hi < lo) {
+                c->error = "Invalid range end";
+                return -1;
+            }
+        }
+        for (int ch = lo; ch <= hi; ch++) {
+            class_set(&cc, ch);
+        }
+    }
+    c->p++;
+
+    if (negate) {
+        for (int i = 0; i < 32; i++) {
+            cc.bits[i] = ~cc.bits[i];
+        }
+    }
+
+    c->classes = grow(c->classes, c->nclasses, sizeof(char_class), c);
+    int n = new_node(c, N_CLASS);
+    if (n < 0) {
+        return -1;
+    }
+    c->classes[c->nclasses] = cc;
+    c->nodes[n].value = c->nclasses++;
+    return n;
+}
+
+static int parse_atom(compiler *c) {
+    int n;
+    switch (*c->p) {
+    case '(': {
+        c->p++;
+        int group = ++c->ngroups;
+        int body = parse_alt(c);
+        if (body < 0) {
+            return -1;
+        }
+        if (*c->p != ')') {
+            c->error = "Unmatched ( or \\(";
+            return -1;
+        }
+        c->p++;
+        n = new_node(c, N_GROUP);
+        if (n >= 0) {
+            c->nodes[n].a = body;
+            c->nodes[n].value = group;
+        }
+        return n;
+    }
+    case '[':
+        return parse_bracket(c);
+    case '.':
+        c->p++;
+        return new_node(c, N_ANY);
+    case '^':
+        c->p++;
+        return new_node(c, N_BOL);
+    case '$':
+        c->p++;
+        return new_node(c, N_EOL);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+        c->error = "Invalid preceding regular expression";
+        return -1;
+    case '\\':
+        c->p++;
+        if (*c->p == '\0') {
+            c->error = "Trailing backslash";
+            return -1;
+        }
+        if (isdigit((unsigned char)*c->p)) {
+            c->error = "Back-references are not supported";
+            return -1;
+        }
+        if (isalpha((unsigned char)*c->p)) {
+            c->error = "Unsupported escape sequence";
+            return -1;
+        }
+        /* fall through */
+    default:
+        n = new_node(c, N_CHAR);
+        if (n >= 0) {
+            c->nodes[n].value = (unsigned char)*c->p++;
+        }
+        return n;
+    }
+}
+
+static bool parse_bound(compiler *c, int *value) {
+    if (!isdigit((unsigned char)*c->p)) {
+        return false;
+    }
+    long v = strtol(c->p, (char **)&c->p, 10);
+    if (v > NFA_DUP_MAX) {
+        c->error = "Regular expression too big";
+        return false;
+    }
+    *value = (int)v;
+    return true;
+}
+
+static int parse_repeat(compiler *c) {
+    int atom = parse_atom(c);
+    while (atom >= 0 && (*c->p == '*' || *c->p == '+' || *c->p == '?' || *c->p == '{')) {
+        int min = 0;
+        int max = -1;
+        char q = *c->p++;
+
+        if (q == '+') {
+            min = 1;
+        } else if (q == '?') {
+            max = 1;
+        } else if (q == '{') {
+            // As in glibc, a missing minimum is 0: {,n} is {0,n}
+            if (*c->p != ',' && !parse_bound(c, &min)) {
+                c->error = c->error ? c->error : "Invalid content of \\{\\}";
+                return -1;
+            }
+            max = min;
+            if (*c->p == ',') {
+                c->p++;
+                max = -1;
+                if (*c->p != '}' && !parse_bound(c, &max)) {
+                    c->error = c->error ? c->error : "Invalid content of \\{\\}";
+                    return -1;
+                }
+            }
+            if (*c->p != '}' || (max != -1 && max < min)) {
+                c->error = "Invalid content of \\{\\}";
+                return -1;
+            }
+            c->p++;
+        }
+
+        int n = new_node(c, N_REPEAT);
+        if (n < 0) {
+            return -1;
+        }
+        c->nodes[n].a = atom;
+        c->nodes[n].min = min;
+        c->nodes[n].max = max;
+        atom = n;
+    }
+    return atom;
+}
+
+static int parse_concat(compiler *c) {
+    int result = -1;
+    while (*c->p != '\0' && *c->p != '|' && *c->p != ')') {
+        int atom = parse_repeat(c);
+        if (atom < 0) {
+            return -1;
+        }
+        result = result < 0 ? atom : new_binary(c, N_CAT, result, atom);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    return result < 0 ? new_node(c, N_EMPTY) : result;
+}
+
+static int parse_alt(compiler *c) {
+    int left = parse_concat(c);
+    while (left >= 0 && *c->p == '|') {
+        c->p++;
+        int right = parse_concat(c);
+        if (right < 0) {
+            return -1;
+        }
+        left = new_binary(c, N_ALT, left, right);
+    }
+    return left;
+}
+
+static int emit(compiler *c, op_code op, int x, int y) {
+    if (c->len >= NFA_MAX_PROGRAM) {
+        c->error = "Regular expression too big";
+        return -1;
+    }
+    c->prog = grow(c->prog, c->len, sizeof(inst), c);
+    if (c->error) {
+        return -1;
+    }
+    c->prog[c->len].op = op;
+    c->prog[c->len].x = x;
+    c->prog[c->len].y = y;
+    return c->len++;
+}
+
+static bool compile_node(compiler *c, int idx) {
+    const node *n = &c->nodes[idx];
+    int split, jmp, loop;
+
+    switch (n->kind) {
+    case N_EMPTY:
+        return true;
+    case N_CHAR:
+        return emit(c, I_CHAR, n->value, 0) >= 0;
+    case N_ANY:
+        return emit(c, I_ANY, 0, 0) >= 0;
+    case N_CLASS:
+        return emit(c, I_CLASS, n->value, 0) >= 0;
+    case N_BOL:
+        return emit(c, I_BOL, 0, 0) >= 0;
+    case N_EOL:
+        return emit(c, I_EOL, 0, 0) >= 0;
+    case N_CAT:
+        return compile_node(c, n->a) && compile_node(c, n->b);
+    case N_ALT:
+        if ((split = emit(c, I_SPLIT, 0, 0)) < 0) {
+            return false;
+        }
+        c->prog[split].x = c->len;
+        if (!compile_node(c, n->a) || (jmp = emit(c, I_JMP, 0, 0)) < 0) {
+            return false;
+        }
+        c->prog[split].y = c->len;
+        if (!compile_node(c, n->b)) {
+            return false;
+        }
+        c->prog[jmp].x = c->len;
+        return true;
+    case N_GROUP:
+        if (n->value < NFA_MAX_GROUPS && emit(c, I_SAVE, 2 * n->value, 0) < 0) {
+            return false;
+        }
+        if (!compile_node(c, n->a)) {
+            return false;
+        }
+        return n->value >= NFA_MAX_GROUPS || emit(c, I_SAVE, 2 * n->value + 1, 0) >= 0;
+    case N_REPEAT:
+        break;
+    }
+
+    // Counted repetition is expanded: min mandatory copies, then either a
+    // loop or (max - min) nested optional copies.
+    int body = n->a;
+    int min = n->min;
+    int max = n->max;
+
+    if (max == -1 && min > 0) {
+        for (int i = 0; i < min - 1; i++) {
+            if (!compile_node(c, body)) {
+                return false;
+            }
+        }
+        loop = c->len;
+        if (!compile_node(c, body) || (split = emit(c, I_SPLIT, loop, 0)) < 0) {
+            return false;
+        }
+        c->prog[split].y = c->len;
+        return true;
+    }
+
+    for (int i = 0; i < min; i++) {
+        if (!compile_node(c, body)) {
+            return false;
+        }
+    }
+
+    if (max == -1) {
+        loop = emit(c, I_SPLIT, 0, 0);
+        if (loop < 0) {
+            return false;
+        }
+        c->prog[loop].x = c->len;
+        if (!compile_node(c, body) || emit(c, I_JMP, loop, 0) < 0) {
+            return false;
+        }
+        c->prog[loop].y = c->len;
+        return true;
+    }
+
+    int first = c->len;
+    for (int i = min; i < max; i++) {
+        if ((split = emit(c, I_SPLIT, 0, -1)) < 0) {
+            return false;
+        }
+        c->prog[split].x = c->len;
+        if (!compile_node(c, body)) {
+            return false;
+        }
+    }
+    // Every optional copy may bail out to the end
+    for (int pc = first; pc < c->len; pc++) {
+        if (c->prog[pc].op == I_SPLIT && c->prog[pc].y == -1) {
+            c->prog[pc].y = c->len;
+        }
+    }
+    return true;
+}
+
+static void nfa_free(void *handle) {
+    nfa *re = handle;
+    if (re == NULL) {
+        return;
+    }
+    free(re->prog);
+    free(re->classes);
+    for (int i = 0; i < 2; i++) {
+        free(re->lists[i].pc);
+        free(re->lists[i].caps);
+    }
+    free(re->mark);
+    free(re->stack);
+    free(re);
+}
+
+static int nfa_compile(void **handle, const char *pattern, size_t *nsub) {
+    compiler c;
+    memset(&c, 0, sizeof(c));
+    c.p = pattern;
+
+    int root = parse_alt(&c);
+    if (root >= 0 && *c.p == ')') {
+        c.error = "Unmatched ) or \\)";
+    }
+    if (!c.error) {
+        emit(&c, I_SAVE, 0, 0);
+    }
+    if (!c.error && compile_node(&c, root)) {
+        emit(&c, I_SAVE, 1, 0);
+        emit(&c, I_MATCH, 0, 0);
+    }
+    free(c.nodes);
+
+    nfa *re = NULL;
+    if (!c.error) {
+        re = calloc(1, sizeof(nfa));
+        if (re == NULL) {
+            c.error = "Out of memory";
+        }
+    }
+    if (c.error) {
+        fprintf(stderr, "Regex error: %s\n", c.error);
+        free(c.prog);
+        free(c.classes);
+        return -1;
+    }
+
+    re->prog = c.prog;
+    re->len = c.len;
+    re->classes = c.classes;
+    re->first_char = re->prog[1].op == I_CHAR ? re->prog[1].x : -1;
+    re->nslots = 2 * (c.ngroups < NFA_MAX_GROUPS ? c.ngroups + 1 : NFA_MAX_GROUPS);
+    for (int i = 0; i < 2; i++) {
+        re->lists[i].pc = malloc(re->len * sizeof(int));
+        re->lists[i].caps = malloc((size_t)re->len * re->nslots * sizeof(regoff_t));
+    }
+    re->mark = calloc(re->len, sizeof(unsigned));
+    re->stack = malloc((2 * re->len + 1) * sizeof(frame));
+    if (!re->lists[0].pc || !re->lists[0].caps || !re->lists[1].pc || !re->lists[1].caps
+            || !re->mark || !re->stack) {
+        fprintf(stderr, "Regex error: Out of memory\n");
+        nfa_free(re);
+        return -1;
+    }
+
+    *handle = re;
+    *nsub = c.ngroups;
+    return 0;
+}
+
+// Add the thread at pc, following every epsilon transition, to list. Threads
+// reach list in priority order and each pc is taken once per step, by the
+// first (highest priority, earliest starting) thread to arrive.
+static void add_thread(nfa *re, thread_list *list, int pc, size_t pos, size_t len,
+                       regoff_t *caps) {
+    int top = 0;
+    re->stack[top++] = (frame){ pc, -1, 0 };
+
+    while (top > 0) {
+        frame f = re->stack[--top];
+        if (f.slot >= 0) {
+            caps[f.slot] = f.old;
+            continue;
+        }
+        if (re->mark[f.pc] == re->gen) {
+            continue;
+        }
+        re->mark[f.pc] = re->gen;
+
+        const inst *in = &re->prog[f.pc];
+        switch (in->op) {
+        case I_JMP:
+            re->stack[top++] = (frame){ in->x, -1, 0 };
+            break;
+        case I_SPLIT:
+            re->stack[top++] = (frame){ in->y, -1, 0 };
+            re->stack[top++] = (frame){ in->x, -1, 0 };
+            break;
+        case I_SAVE:
+            re->stack[top++] = (frame){ 0, in->x, caps[in->x] };
+            caps[in->x] = pos;
+            re->stack[top++] = (frame){ f.pc + 1, -1, 0 };
+            break;
+        case I_BOL:
+            if (pos == 0) {
+                re->stack[top++] = (frame){ f.pc + 1, -1, 0 };
+            }
+            break;
+        case I_EOL:
+            if (pos == len) {
+                re->stack[top++] = (frame){ f.pc + 1, -1, 0 };
+            }
+            break;
+        default:
+            list->pc[list->n] = f.pc;
+            memcpy(list->caps + (size_t)list->n * re->nslots, caps, sizeof(regoff_t) * re->nslots);
+            list->n++;
+            break;
+        }
+    }
+}
+
+static void next_generation(nfa *re) {
+    if (++re->gen == 0) {
+        memset(re->mark, 0, re->len * sizeof(unsigned));
+        re->gen = 1;
+    }
+}
+
+static int nfa_exec(void *handle, const char *text, size_t len,
+                    regmatch_t *matches, size_t nmatch) {
+    nfa *re = handle;
+    thread_list *clist = &re->lists[0];
+    thread_list *nlist = &re->lists[1];
+    regoff_t caps[NFA_SLOTS];
+    regoff_t best[NFA_SLOTS];
+    bool matched = false;
+
+    clist->n = 0;
+    next_generation(re);
+
+    for (size_t pos = 0; ; pos++) {
+        if (!matched) {
+            if (clist->n == 0 && re->first_char >= 0) {
+                // Nothing in flight: jump to the next possible start
+                const char *hit = pos < len ? memchr(text + pos, re->first_char, len - pos) : NULL;
+                if (hit == NULL) {
+                    break;
+                }
+                pos = hit - text;
+            }
+            for (int i = 0; i < re->nslots; i++) {
+                caps[i] = -1;
+            }
+            add_thread(re, clist, 0, pos, len, caps);
+        }
+
+        next_generation(re);
+        nlist->n = 0;
+        int c = pos < len ? (unsigned char)text[pos] : -1;
+
+        for (int i = 0; i < clist->n; i++) {
+            regoff_t *tcaps = clist->caps + (size_t)i * re->nslots;
+            if (matched && tcaps[0] > best[0]) {
+                continue;  // Starts right of the match already found
+            }
+
+            const inst *in = &re->prog[clist->pc[i]];
+            bool step = false;
+            switch (in->op) {
+            case I_CHAR:
+                step = c == in->x;
+                break;
+            case I_ANY:
+                step = c >= 0;
+                break;
+            case I_CLASS:
+                step = c >= 0 && class_has(&re->classes[in->x], c);
+                break;
+            case I_MATCH:
+                if (!matched || tcaps[0] < best[0]
+                        || (tcaps[0] == best[0] && tcaps[1] > best[1])) {
+                    memcpy(best, tcaps, sizeof(regoff_t) * re->nslots);
+                    matched = true;
+                }
+                break;
+            default:
+                break;
+            }
+            if (step) {
+                add_thread(re, nlist, clist->pc[i] + 1, pos + 1, len, tcaps);
+            }
+        }
+
+        thread_list *tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+
+        if (pos >= len || (matched && clist->n == 0)) {
+            break;
+        }
+    }
+
+    if (!matched) {
+        return 0;
+    }
+    for (size_t i = 0; i < nmatch; i++) {
+        bool recorded = 2 * i < (size_t)re->nslots && best[2 * i] != -1 && best[2 * i + 1] != -1;
+        matches[i].rm_so = recorded ? best[2 * i] : -1;
+        matches[i].rm_eo = recorded ? best[2 * i + 1] : -1;
+    }
+    return 1;
+}
+
+const regex_engine nfa_engine = {
+    "nfa",
+    nfa_compile,
+    nfa_exec,
+    nfa_free,
+};
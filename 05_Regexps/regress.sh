@@ -0,0 +1,220 @@
+#!/bin/bash
+# Regression and throughput suite for esub against sed -E.
+#
+# Usage: ./regress.sh [-s SEED] [-n PATTERNS] [-l LINES] [-m MB] [check|throughput|all]
+#
+#   check       Generate random EREs and inputs from SEED and compare esub
+#               (both engines, sequential, threaded, rules files) with sed -E
+#   throughput  Time esub and sed -E on a MB-sized log file and report
+#               lines/s and MB/s
+#
+# Exits non-zero if any check fails. Failing cases are printed with the
+# pattern and replacement so they can be reproduced by hand.
+
+set -e
+
+ESUB=${ESUB:-./esub}
+seed=1
+npatterns=300
+nlines=2000
+size_mb=64
+
+while getopts "s:n:l:m:" opt; do
+    case $opt in
+        s) seed=$OPTARG ;;
+        n) npatterns=$OPTARG ;;
+        l) nlines=$OPTARG ;;
+        m) size_mb=$OPTARG ;;
+        *) sed -n '2,13s/^# \{0,1\}//p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+mode=${1:-all}
+
+workdir=$(mktemp -d)
+trap 'rm -rf "$workdir"' EXIT
+
+threads=$(nproc 2>/dev/null || echo 4)
+failures=0
+
+# Random EREs over a small alphabet so that they actually match. Groups are
+# emitted first so that every pattern has at least one capture.
+gen_patterns() {
+    awk -v seed="$seed" -v n="$npatterns" '
+    function pick(s) { return substr(s, int(rand() * length(s)) + 1, 1) }
+    function atom(depth,    r) {
+        r = rand()
+        if (r < 0.45) return pick("abcd")
+        if (r < 0.55) return "."
+        if (r < 0.65) return pick("1234") == "1" ? "[ab]" : (rand() < 0.5 ? "[^a]" : "[b-d]")
+        if (r < 0.70) return "[[:alpha:]]"
+        if (r < 0.85 && depth < 3) return "(" alt(depth + 1) ")"
+        return pick("abcd")
+    }
+    function quant(a,    r) {
+        r = rand()
+        if (r < 0.15) return a "*"
+        if (r < 0.25) return a "+"
+        if (r < 0.32) return a "?"
+        if (r < 0.37) return a "{" int(rand() * 2) "," (2 + int(rand() * 2)) "}"
+        return a
+    }
+    function seq(depth,    s, i, k) {
+        k = 1 + int(rand() * 4)
+        s = ""
+        for (i = 0; i < k; i++) s = s quant(atom(depth))
+        return s
+    }
+    function alt(depth,    s) {
+        s = seq(depth)
+        if (depth > 0 && rand() < 0.2) s = s "|" seq(depth)
+        return s
+    }
+    BEGIN {
+        srand(seed)
+        for (i = 0; i < n; i++) {
+            p = "(" alt(1) ")" seq(0)
+            if (rand() < 0.2) p = "^" p
+            if (rand() < 0.2) p = p "$"
+            print p
+        }
+    }'
+}
+
+gen_lines() {
+    awk -v seed="$1" -v n="$2" 'BEGIN {
+        srand(seed)
+        for (i = 0; i < n; i++) {
+            k = int(rand() * 16)
+            s = ""
+            for (j = 0; j < k; j++) s = s substr("abcdab-1 ", int(rand() * 9) + 1, 1)
+            print s
+        }
+    }'
+}
+
+# Replacement referencing every group the pattern has (up to 9)
+replacement_for() {
+    local pattern=$1 groups i rep="<\\0>"
+    groups=$(printf '%s' "$pattern" | tr -cd '(' | wc -c)
+    for ((i = 1; i <= groups && i <= 9; i++)); do
+        rep="$rep[\\$i]"
+    done
+    printf '%s' "$rep"
+}
+
+fail() {
+    failures=$((failures + 1))
+    echo "FAIL: $*"
+}
+
+run_check() {
+    gen_patterns > "$workdir/patterns.txt"
+    gen_lines "$seed" "$nlines" > "$workdir/input.txt"
+    # A large input so the threaded path splits into several chunks: esub
+    # only goes parallel above CHUNK_SIZE (4 MB). 40 blocks of 5000 lines
+    # are about 1.7 MB, repeated 8 times for about 14 MB.
+    for i in $(seq 1 40); do gen_lines $((seed + i)) 5000; done > "$workdir/block.txt"
+    for i in $(seq 1 8); do cat "$workdir/block.txt"; done > "$workdir/large.txt"
+    [ "$(wc -c < "$workdir/large.txt")" -gt $((3 * 4 * 1024 * 1024)) ] \
+        || fail "large input is only $(wc -c < "$workdir/large.txt") bytes, below 3 chunks"
+
+    local count=0 pattern rep
+    while IFS= read -r pattern; do
+        rep=$(replacement_for "$pattern")
+        sed -E "s/$pattern/$rep/" "$workdir/input.txt" > "$workdir/sed.txt"
+
+        "$ESUB" -f "$workdir/input.txt" "$pattern" "$rep" > "$workdir/esub.txt" 2>&1 \
+            && cmp -s "$workdir/sed.txt" "$workdir/esub.txt" \
+            || fail "posix: s/$pattern/$rep/"
+
+        # The NFA engine agrees on the whole match; ambiguous patterns may
+        # pick different submatches, so only \0 is compared
+        sed -E "s/$pattern/<\\0>/" "$workdir/input.txt" > "$workdir/sed0.txt"
+        "$ESUB" -m nfa -f "$workdir/input.txt" "$pattern" "<\\0>" > "$workdir/esub.txt" 2>&1 \
+            && cmp -s "$workdir/sed0.txt" "$workdir/esub.txt" \
+            || fail "nfa: s/$pattern/<\\0>/"
+
+        count=$((count + 1))
+    done < "$workdir/patterns.txt"
+    echo "Checked $count random patterns on $nlines lines against sed -E"
+
+    # Threads, rules files and the prefilter on a large input. -j 1 would
+    # stay sequential, so a single CPU still checks with several threads.
+    local jobs=$((threads > 1 ? threads : 4))
+    head -n 20 "$workdir/patterns.txt" > "$workdir/some.txt"
+    : > "$workdir/rules.txt"
+    local sed_args=()
+    while IFS= read -r pattern; do
+        rep=$(replacement_for "$pattern")
+        printf '%s\t%s\n' "$pattern" "$rep" >> "$workdir/rules.txt"
+        sed_args+=(-e "s/$pattern/$rep/")
+
+        sed -E "s/$pattern/$rep/" "$workdir/large.txt" > "$workdir/sed.txt"
+        "$ESUB" -j "$jobs" -f "$workdir/large.txt" "$pattern" "$rep" > "$workdir/esub.txt" \
+            && cmp -s "$workdir/sed.txt" "$workdir/esub.txt" \
+            || fail "threaded: s/$pattern/$rep/"
+    done < "$workdir/some.txt"
+
+    sed -E "${sed_args[@]}" "$workdir/large.txt" > "$workdir/sed.txt"
+    "$ESUB" -j "$jobs" -r "$workdir/rules.txt" -f "$workdir/large.txt" > "$workdir/esub.txt" \
+        && cmp -s "$workdir/sed.txt" "$workdir/esub.txt" \
+        || fail "rules file with $(wc -l < "$workdir/rules.txt") rules"
+
+    sed -E "s/ab-1 ([a-d]+)/<\\1>/" "$workdir/large.txt" > "$workdir/sed.txt"
+    "$ESUB" -f "$workdir/large.txt" "ab-1 ([a-d]+)" "<\\1>" > "$workdir/esub.txt" \
+        && cmp -s "$workdir/sed.txt" "$workdir/esub.txt" \
+        || fail "prefilter: s/ab-1 ([a-d]+)/<\\1>/"
+    echo "Checked threaded, rules file and prefilter paths on $(wc -l < "$workdir/large.txt") lines"
+}
+
+# Print seconds, lines/s and MB/s for one command reading $input
+measure() {
+    local label=$1 input=$2
+    shift 2
+    local start end
+    start=$EPOCHREALTIME
+    "$@" > /dev/null
+    end=$EPOCHREALTIME
+    awk -v l="$label" -v s="$start" -v t="$end" -v n="$(wc -l < "$input")" \
+        -v b="$(stat -c %s "$input")" 'BEGIN {
+        d = t - s; if (d <= 0) d = 1e-6
+        printf "  %-22s %8.3f s %12.0f lines/s %9.1f MB/s\n", l, d, n / d, b / d / 1048576
+    }'
+}
+
+run_throughput() {
+    local input="$workdir/log.txt"
+    local lines=$((size_mb * 1048576 / 85))
+    seq 1 "$lines" | awk '{
+        printf "2025-%02d-%02d 12:%02d:%02d host%d sshd[%d]: user%d@example.com from 10.0.%d.%d port %d\n",
+               $1 % 12 + 1, $1 % 28 + 1, $1 % 60, $1 % 60, $1 % 7, $1, $1 % 97, $1 % 256, $1 % 200, $1 % 65536
+    }' > "$input"
+
+    echo "Throughput on $(wc -l < "$input") lines ($(($(stat -c %s "$input") / 1048576)) MB), $threads threads:"
+    local pattern rep
+    for pair in "user([0-9]+)@example\\.com	\\1" \
+                "([0-9]+)-([0-9]+)-([0-9]+)	\\3.\\2.\\1" \
+                "port 6553[0-9]$	port X" \
+                "from ([0-9]+\\.){3}[0-9]+	from ANON"; do
+        pattern=${pair%%	*}
+        rep=${pair#*	}
+        echo "s/$pattern/$rep/"
+        measure "sed -E" "$input" sed -E "s/$pattern/$rep/" "$input"
+        measure "esub" "$input" "$ESUB" -f "$input" "$pattern" "$rep"
+        measure "esub -j $threads" "$input" "$ESUB" -j "$threads" -f "$input" "$pattern" "$rep"
+        measure "esub -m nfa -j $threads" "$input" "$ESUB" -m nfa -j "$threads" -f "$input" "$pattern" "$rep"
+    done
+}
+
+case $mode in
+    check) run_check ;;
+    throughput) run_throughput ;;
+    all) run_check; run_throughput ;;
+    *) echo "Unknown mode: $mode"; exit 1 ;;
+esac
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Compare move's copy methods on one large file and on a tree of small files.
+#
+# Usage: ./bench_copy.sh [SIZE_MB] [FILES]
+#
+# Files are created in BENCH_SRC (default: a directory under /tmp) and moved
+# to BENCH_DST (default: next to the source); point BENCH_DST at another
+# filesystem to measure cross-device moves. Set DROP_CACHES=1 (as root) to
+# start every run with a cold page cache, which is where io_uring's queue
+# depth pays off; with a warm cache all methods are bound by memory copies.
+
+set -e
+
+MOVE=${MOVE:-./move}
+size_mb=${1:-256}
+nfiles=${2:-2000}
+
+src=${BENCH_SRC:-$(mktemp -d)}
+dst=${BENCH_DST:-$src}/bench_dst.$$
+trap 'rm -rf "$src/bench_ref" "$src/bench_tree_ref" "$src/bench_src" "$dst"' EXIT
+
+head -c $((size_mb * 1048576)) /dev/urandom > "$src/bench_ref"
+mkdir -p "$src/bench_tree_ref"
+for i in $(seq 1 "$nfiles"); do
+    head -c $((4096 + i % 7 * 4096)) /dev/urandom > "$src/bench_tree_ref/f$i"
+done
+tree_bytes=$(du -sb "$src/bench_tree_ref" | cut -f1)
+
+drop_caches() {
+    sync
+    if [ "${DROP_CACHES:-0}" = 1 ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+# Time one move of $1 (a file or tree copied to the source path first)
+bench() {
+    local label=$1 ref=$2 bytes=$3
+    shift 3
+    rm -rf "$src/bench_src" "$dst"
+    cp -a "$ref" "$src/bench_src"
+    drop_caches
+    local start=$EPOCHREALTIME
+    "$MOVE" "$@" "$src/bench_src" "$dst"
+    local end=$EPOCHREALTIME
+    awk -v l="$label" -v s="$start" -v t="$end" -v b="$bytes" 'BEGIN {
+        d = t - s; if (d <= 0) d = 1e-6
+        printf "  %-28s %8.3f s %9.1f MB/s\n", l, d, b / d / 1048576
+    }'
+}
+
+echo "One ${size_mb} MB file:"
+for m in copy_file_range sendfile uring rw; do
+    bench "$m" "$src/bench_ref" $((size_mb * 1048576)) -m "$m"
+done
+
+echo ""
+echo "$nfiles small files ($((tree_bytes / 1024)) KB):"
+for m in copy_file_range sendfile uring rw; do
+    bench "$m -j 1" "$src/bench_tree_ref" "$tree_bytes" -m "$m" -j 1
+    bench "$m -j $(nproc)" "$src/bench_tree_ref" "$tree_bytes" -m "$m" -j "$(nproc)"
+done
+
+if [ -z "$BENCH_SRC" ]; then
+    rm -rf "$src"
+fi
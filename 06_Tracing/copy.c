@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "move.h"
+
+// The read/write loop uses a page-aligned buffer between these sizes,
+// scaled with the file so that small files do not allocate megabytes
+#define MIN_BUFFER_SIZE (1L << 20)
+#define MAX_BUFFER_SIZE (8L << 20)
+
+// Largest request for copy_file_range/sendfile; the kernel caps a single
+// call at about 2 GB anyway
+#define RANGE_CHUNK (1L << 30)
+
+const char* const method_names[] = {
+    [METHOD_AUTO] = "auto",
+    [METHOD_CLONE] = "clone",
+    [METHOD_COPY_RANGE] = "copy_file_range",
+    [METHOD_SENDFILE] = "sendfile",
+    [METHOD_URING] = "uring",
+    [METHOD_RW] = "rw"
+};
+
+// Errors that mean "this method cannot be used for these two files", as
+// opposed to an I/O failure
+static int unsupported_errno(int err) {
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP ||
+           err == ENOTTY || err == EINVAL || err == EBADF;
+}
+
+// Share the source extents with the destination (btrfs, XFS, ...). This
+// succeeds between btrfs subvolumes even though rename() reports EXDEV.
+static enum copy_result copy_clone(int source_fd, int dest_fd) {
+    if (ioctl(dest_fd, FICLONE, source_fd) == 0)
+        return COPY_DONE;
+    return unsupported_errno(errno) ? COPY_UNSUPPORTED : COPY_WRITE_ERROR;
+}
+
+// In-kernel copy; may be offloaded to the storage or done as a reflink
+static enum copy_result copy_range(int source_fd, int dest_fd) {
+    off_t copied = 0;
+    ssize_t n;
+
+    while ((n = copy_file_range(source_fd, NULL, dest_fd, NULL, RANGE_CHUNK, 0)) > 0) {
+        copied += n;
+        progress_add(n);
+    }
+
+    if (n == -1)
+        return copied == 0 && unsupported_errno(errno) ? COPY_UNSUPPORTED : COPY_WRITE_ERROR;
+    return COPY_DONE;
+}
+
+// Page cache to page cache without a round trip through user space
+static enum copy_result copy_sendfile(int source_fd, int dest_fd) {
+    off_t copied = 0;
+    ssize_t n;
+
+    while ((n = sendfile(dest_fd, source_fd, NULL, RANGE_CHUNK)) > 0) {
+        copied += n;
+        progress_add(n);
+    }
+
+    if (n == -1)
+        return copied == 0 && unsupported_errno(errno) ? COPY_UNSUPPORTED : COPY_WRITE_ERROR;
+    return COPY_DONE;
+}
+
+// Smallest power of two holding 1/8 of the file, within the buffer limits,
+// but never more than the file rounded up to a page
+static size_t buffer_size_for(off_t file_size) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = MIN_BUFFER_SIZE;
+
+    while (size < MAX_BUFFER_SIZE && (off_t)size * 8 < file_size)
+        size *= 2;
+    if (file_size < (off_t)size)
+        size = file_size > 0 ? (size_t)(file_size + page - 1) / page * page : (size_t)page;
+    return size;
+}
+
+// write() may return short counts (signals, quotas reached mid-buffer);
+// keep going until everything is written or a real error is reported
+static int write_all(int fd, const char* buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write back the window written before the current one and drop it from
+// the page cache; the current window is only queued for writeback so the
+// disk stays busy while the next buffer is read
+static void release_written(int dest_fd, off_t window_start, off_t window_len) {
+    sync_file_range(dest_fd, window_start, window_len, SYNC_FILE_RANGE_WRITE);
+    if (window_start >= window_len) {
+        off_t previous = window_start - window_len;
+        sync_file_range(dest_fd, previous, window_len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(dest_fd, previous, window_len, POSIX_FADV_DONTNEED);
+    }
+}
+
+// A file whose allocated blocks do not cover its size has holes
+static int is_sparse(const struct stat* st) {
+    return (off_t)st->st_blocks * 512 < st->st_size;
+}
+
+// Copy source bytes from start until end (or EOF for end == -1) to the
+// same offsets in the destination
+static enum copy_result copy_extent(int source_fd, int dest_fd, char* buffer, size_t buffer_size,
+                                    off_t start, off_t end) {
+    if (lseek(source_fd, start, SEEK_SET) == -1)
+        return COPY_READ_ERROR;
+    if (lseek(dest_fd, start, SEEK_SET) == -1)
+        return COPY_WRITE_ERROR;
+
+    off_t offset = start;
+    while (end == -1 || offset < end) {
+        size_t want = buffer_size;
+        if (end != -1 && (off_t)want > end - offset)
+            want = end - offset;
+
+        ssize_t bytes_read = read(source_fd, buffer, want);
+        if (bytes_read == 0)
+            break;
+        if (bytes_read == -1) {
+            if (errno == EINTR)
+                continue;
+            return COPY_READ_ERROR;
+        }
+        if (write_all(dest_fd, buffer, bytes_read) == -1)
+            return COPY_WRITE_ERROR;
+        progress_add(bytes_read);
+
+        // The source is about to be removed, nobody needs its pages
+        posix_fadvise(source_fd, offset, bytes_read, POSIX_FADV_DONTNEED);
+        if ((size_t)bytes_read == buffer_size)
+            release_written(dest_fd, offset, bytes_read);
+        offset += bytes_read;
+    }
+
+    return COPY_DONE;
+}
+
+// Copy only the data extents of a sparse file; the holes between them are
+// left unwritten and the trailing one is recreated with ftruncate
+static enum copy_result copy_sparse(int source_fd, int dest_fd, char* buffer, size_t buffer_size,
+                                    off_t size) {
+    off_t offset = 0;
+
+    while (offset < size) {
+        off_t data = lseek(source_fd, offset, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) {
+                progress_add(size - offset);
+                break; // only a hole remains
+            }
+            // No SEEK_DATA support: copy the rest as if it were dense
+            return copy_extent(source_fd, dest_fd, buffer, buffer_size, offset, -1);
+        }
+        progress_add(data - offset);
+        off_t hole = lseek(source_fd, data, SEEK_HOLE);
+        if (hole == -1)
+            return COPY_READ_ERROR;
+
+        enum copy_result result = copy_extent(source_fd, dest_fd, buffer, buffer_size, data, hole);
+        if (result != COPY_DONE)
+            return result;
+        offset = hole;
+    }
+
+    return ftruncate(dest_fd, size) == -1 ? COPY_WRITE_ERROR : COPY_DONE;
+}
+
+static enum copy_result copy_rw(int source_fd, int dest_fd, const struct stat* source_stat) {
+    size_t buffer_size = buffer_size_for(source_stat->st_size);
+    char* buffer;
+    int err = posix_memalign((void**)&buffer, sysconf(_SC_PAGESIZE), buffer_size);
+    if (err != 0) {
+        errno = err;
+        return COPY_WRITE_ERROR;
+    }
+
+    // Hints only: failures (e.g. on pipes or filesystems without
+    // preallocation) do not affect the copy. Preallocating a sparse file
+    // would fill its holes.
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    enum copy_result result;
+    if (is_sparse(source_stat)) {
+        result = copy_sparse(source_fd, dest_fd, buffer, buffer_size, source_stat->st_size);
+    } else {
+        if (source_stat->st_size > 0)
+            fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, 0, source_stat->st_size);
+        result = copy_extent(source_fd, dest_fd, buffer, buffer_size, 0, -1);
+    }
+
+    err = errno;
+    free(buffer);
+    errno = err;
+    return result;
+}
+
+// Run the copy chain starting at method. Stores the method that did the
+// copy in *used.
+static enum copy_result copy_data(int source_fd, int dest_fd, const struct stat* source_stat,
+                                  enum copy_method method, enum copy_method* used) {
+    enum copy_result result = COPY_UNSUPPORTED;
+
+    for (int m = method == METHOD_AUTO ? METHOD_CLONE : method;
+         m <= METHOD_RW && result == COPY_UNSUPPORTED; m++) {
+        *used = m;
+        switch (m) {
+        case METHOD_CLONE:
+            result = copy_clone(source_fd, dest_fd);
+            if (result == COPY_DONE)
+                progress_add(source_stat->st_size);
+            break;
+        // Across filesystems these write out holes as zeros; the
+        // read/write loop copies only the data extents
+        case METHOD_COPY_RANGE:
+            result = is_sparse(source_stat) ? COPY_UNSUPPORTED : copy_range(source_fd, dest_fd);
+            break;
+        case METHOD_SENDFILE:
+            result = is_sparse(source_stat) ? COPY_UNSUPPORTED : copy_sendfile(source_fd, dest_fd);
+            break;
+        case METHOD_URING:
+            result = is_sparse(source_stat) ? COPY_UNSUPPORTED : copy_uring(source_fd, dest_fd, source_stat);
+            break;
+        default:
+            result = copy_rw(source_fd, dest_fd, source_stat);
+            break;
+        }
+    }
+
+    return result;
+}
+
+
+// Best effort: attributes the destination filesystem or our privileges do
+// not allow (trusted.*, security.* as non-root) are skipped
+static void copy_xattrs(int source_fd, int dest_fd) {
+    ssize_t list_size = flistxattr(source_fd, NULL, 0);
+    if (list_size <= 0)
+        return;
+
+    char* names = malloc(list_size);
+    if (names == NULL)
+        return;
+    list_size = flistxattr(source_fd, names, list_size);
+
+    char* value = NULL;
+    size_t value_capacity = 0;
+    for (ssize_t i = 0; i < list_size; i += strlen(names + i) + 1) {
+        ssize_t value_size = fgetxattr(source_fd, names + i, NULL, 0);
+        if (value_size < 0)
+            continue;
+        if ((size_t)value_size > value_capacity) {
+            char* grown = realloc(value, value_size);
+            if (grown == NULL)
+                break;
+            value = grown;
+            value_capacity = value_size;
+        }
+        value_size = fgetxattr(source_fd, names + i, value, value_capacity);
+        if (value_size >= 0)
+            fsetxattr(dest_fd, names + i, value, value_size, 0);
+    }
+
+    free(value);
+    free(names);
+}
+
+int sync_path(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    int result = fsync(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return result;
+}
+
+int sync_parent(const char* path) {
+    char* copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    int result = sync_path(dirname(copy));
+    int err = errno;
+    free(copy);
+    errno = err;
+    return result;
+}
+
+int copy_metadata(int source_fd, int dest_fd, const struct stat* source_stat) {
+    mode_t mode = source_stat->st_mode & 07777;
+
+    // Changing the owner clears the set-id bits, so it goes first. If it is
+    // not allowed, the set-id bits must not be given to our own file.
+    if (fchown(dest_fd, source_stat->st_uid, source_stat->st_gid) == -1)
+        mode &= ~(S_ISUID | S_ISGID);
+    if (fchmod(dest_fd, mode) == -1)
+        return -1;
+
+    copy_xattrs(source_fd, dest_fd);
+
+    struct timespec times[2] = {source_stat->st_atim, source_stat->st_mtim};
+    return futimens(dest_fd, times);
+}
+
+enum move_error copy_file(const char* source_path, const char* dest_path,
+                          const struct stat* source_stat, enum copy_method method,
+                          int flags, enum copy_method* used) {
+    int source_fd = open(source_path, O_RDONLY);
+    if (source_fd == -1) {
+        fprintf(stderr, "Error: Cannot open source file - %s\n", strerror(errno));
+        return ERR_OPEN_SOURCE;
+    }
+
+    // Private until the copy is complete and the source mode is applied
+    int dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC,
+                       flags & COPY_METADATA ? 0600 : 0644);
+    if (dest_fd == -1) {
+        close(source_fd);
+        fprintf(stderr, "Error: Cannot open destination file - %s\n", strerror(errno));
+        return ERR_OPEN_DEST;
+    }
+
+    *used = method;
+    enum copy_result result = copy_data(source_fd, dest_fd, source_stat, method, used);
+
+    if (result == COPY_WRITE_ERROR) {
+        int err = errno;
+        close(source_fd);
+        close(dest_fd);
+        unlink(dest_path);
+        fprintf(stderr, "Error: Failed to write to destination file - %s\n", strerror(err));
+        return ERR_WRITE_DEST;
+    }
+
+    if (result == COPY_READ_ERROR) {
+        int err = errno;
+        close(source_fd);
+        close(dest_fd);
+        unlink(dest_path);
+        fprintf(stderr, "Error: Failed to read source file - %s\n", strerror(err));
+        return ERR_READ_SOURCE;
+    }
+
+    if ((flags & COPY_METADATA) && copy_metadata(source_fd, dest_fd, source_stat) == -1) {
+        int err = errno;
+        close(source_fd);
+        close(dest_fd);
+        unlink(dest_path);
+        fprintf(stderr, "Error: Cannot set destination attributes - %s\n", strerror(err));
+        return ERR_WRITE_DEST;
+    }
+
+    if ((flags & COPY_FSYNC) && fsync(dest_fd) == -1) {
+        int err = errno;
+        close(source_fd);
+        close(dest_fd);
+        unlink(dest_path);
+        fprintf(stderr, "Error: Failed to sync destination file - %s\n", strerror(err));
+        return ERR_WRITE_DEST;
+    }
+
+    if (close(source_fd) == -1) {
+        close(dest_fd);
+        unlink(dest_path);
+        fprintf(stderr, "Error: Failed to close source file - %s\n", strerror(errno));
+        return ERR_CLOSE_FILES;
+    }
+
+    if (close(dest_fd) == -1) {
+        unlink(dest_path);
+        fprintf(stderr, "Error: Failed to close destination file - %s\n", strerror(errno));
+        return ERR_CLOSE_FILES;
+    }
+
+    return ERR_OK;
+}
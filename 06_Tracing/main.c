@@ -1,87 +1,166 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <fcntl.h>
 
-#define BUFFER_SIZE 4096
+#include "move.h"
 
-int main(int argc, char** argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s infile outfile\n", argv[0]);
-        return 1; // ERR_USAGE
+static void print_usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-pv] [-m METHOD] [-j N] infile outfile\n", prog);
+    fprintf(stderr, "       %s [-pv] [-m METHOD] [-j N] indir outdir\n", prog);
+    fprintf(stderr, "  -m, --method=METHOD  auto (rename, then the copy methods in order),\n");
+    fprintf(stderr, "                       clone, copy_file_range, sendfile, uring or rw\n");
+    fprintf(stderr, "  -j, --jobs=N         files copied in parallel when moving a directory\n");
+    fprintf(stderr, "                       across filesystems (default: number of CPUs)\n");
+    fprintf(stderr, "  -p, --progress       show bytes copied, rate and ETA while copying and\n");
+    fprintf(stderr, "                       a summary with wall and CPU time at the end\n");
+    fprintf(stderr, "  -v, --verbose        report how the file was moved\n");
+    fprintf(stderr, "      --durable        sync the data and both directories before\n");
+    fprintf(stderr, "                       reporting success\n");
+}
+
+static enum move_error move_file(const char* source_path, const char* dest_path,
+                                 const struct stat* source_stat, const struct move_options* options) {
+    // Same filesystem: just relink the inode. On any failure fall through to
+    // the copy, which reports the error in detail if it is not just EXDEV.
+    // A durable rename needs the data on disk first and both directory
+    // entries afterwards.
+    if (options->method == METHOD_AUTO &&
+        (!options->durable || sync_path(source_path) == 0) &&
+        rename(source_path, dest_path) == 0) {
+        if (options->durable && (sync_parent(dest_path) == -1 || sync_parent(source_path) == -1)) {
+            fprintf(stderr, "Error: Failed to sync directory - %s\n", strerror(errno));
+            return ERR_WRITE_DEST;
+        }
+        if (options->verbose)
+            fprintf(stderr, "%s -> %s (rename)\n", source_path, dest_path);
+        return ERR_OK;
     }
 
-    const char* source_path = argv[1];
-    const char* dest_path = argv[2];
+    enum copy_method used;
+    enum move_error error = copy_file(source_path, dest_path, source_stat, options->method,
+                                      COPY_METADATA | (options->durable ? COPY_FSYNC : 0), &used);
+    if (error != ERR_OK)
+        return error;
 
-    if (strcmp(source_path, dest_path) == 0) {
-        fprintf(stderr, "Error: Source and destination are the same file\n");
-        return 1; // ERR_USAGE
+    // The new name must survive a crash before the old one is dropped
+    if (options->durable && sync_parent(dest_path) == -1) {
+        fprintf(stderr, "Error: Failed to sync destination directory - %s\n", strerror(errno));
+        unlink(dest_path);
+        return ERR_WRITE_DEST;
     }
 
-    struct stat source_stat;
-    if (stat(source_path, &source_stat) == -1) {
-        fprintf(stderr, "Error: Cannot stat source file - %s\n", strerror(errno));
-        return 9; // ERR_STAT_SOURCE
+    if (unlink(source_path) == -1) {
+        fprintf(stderr, "Error: Failed to remove source file - %s\n", strerror(errno));
+        return ERR_REMOVE_SOURCE;
     }
 
-    int source_fd = open(source_path, O_RDONLY);
-    if (source_fd == -1) {
-        fprintf(stderr, "Error: Cannot open source file - %s\n", strerror(errno));
-        return 2; // ERR_OPEN_SOURCE
+    if (options->durable && sync_parent(source_path) == -1) {
+        fprintf(stderr, "Error: Failed to sync source directory - %s\n", strerror(errno));
+        return ERR_REMOVE_SOURCE;
     }
 
-    int dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dest_fd == -1) {
-        close(source_fd);
-        fprintf(stderr, "Error: Cannot open destination file - %s\n", strerror(errno));
-        return 3; // ERR_OPEN_DEST
-    }
+    if (options->verbose)
+        fprintf(stderr, "%s -> %s (%s)\n", source_path, dest_path, method_names[used]);
+
+    return ERR_OK;
+}
+
+int main(int argc, char** argv) {
+    static const struct option long_options[] = {
+        {"method", required_argument, NULL, 'm'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"durable", no_argument, NULL, 'D'},
+        {"progress", no_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+    struct move_options options = {
+        .method = METHOD_AUTO,
+        .jobs = sysconf(_SC_NPROCESSORS_ONLN),
+    };
+    char* end;
+    int c;
 
-    // Copy data using read/write
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written;
-    
-    while ((bytes_read = read(source_fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            close(source_fd);
-            close(dest_fd);
-            unlink(dest_path);
-            fprintf(stderr, "Error: Failed to write to destination file - %s\n", strerror(errno));
-            return 5; // ERR_WRITE_DEST
+    while ((c = getopt_long(argc, argv, "j:m:pv", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            for (options.method = METHOD_AUTO; options.method <= METHOD_RW; options.method++)
+                if (strcmp(optarg, method_names[options.method]) == 0)
+                    break;
+            if (options.method > METHOD_RW) {
+                fprintf(stderr, "Error: Unknown copy method '%s'\n", optarg);
+                return ERR_USAGE;
+            }
+            break;
+        case 'j':
+            options.jobs = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || options.jobs < 1) {
+                fprintf(stderr, "Error: Invalid number of jobs '%s'\n", optarg);
+                return ERR_USAGE;
+            }
+            break;
+        case 'v':
+            options.verbose = 1;
+            break;
+        case 'p':
+            options.progress = 1;
+            break;
+        case 'D':
+            options.durable = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            return ERR_USAGE;
         }
     }
+    if (options.jobs < 1)
+        options.jobs = 1;
 
-    if (bytes_read == -1) {
-        close(source_fd);
-        close(dest_fd);
-        unlink(dest_path);
-        fprintf(stderr, "Error: Failed to read source file - %s\n", strerror(errno));
-        return 4; // ERR_READ_SOURCE
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return ERR_USAGE;
     }
 
-    if (close(source_fd) == -1) {
-        close(dest_fd);
-        unlink(dest_path);
-        fprintf(stderr, "Error: Failed to close source file - %s\n", strerror(errno));
-        return 6; // ERR_CLOSE_FILES
+    const char* source_path = argv[optind];
+    const char* dest_path = argv[optind + 1];
+
+    if (strcmp(source_path, dest_path) == 0) {
+        fprintf(stderr, "Error: Source and destination are the same file\n");
+        return ERR_USAGE;
     }
 
-    if (close(dest_fd) == -1) {
-        unlink(dest_path);
-        fprintf(stderr, "Error: Failed to close destination file - %s\n", strerror(errno));
-        return 6; // ERR_CLOSE_FILES
+    struct stat source_stat;
+    if (stat(source_path, &source_stat) == -1) {
+        fprintf(stderr, "Error: Cannot stat source file - %s\n", strerror(errno));
+        return ERR_STAT_SOURCE;
     }
 
-    if (unlink(source_path) == -1) {
-        fprintf(stderr, "Error: Failed to remove source file - %s\n", strerror(errno));
-        return 7; // ERR_REMOVE_SOURCE
+    // Different names for one inode: rename() would succeed without doing
+    // anything and the copy would truncate the source
+    struct stat dest_stat;
+    if (stat(dest_path, &dest_stat) == 0 && dest_stat.st_dev == source_stat.st_dev &&
+        dest_stat.st_ino == source_stat.st_ino) {
+        fprintf(stderr, "Error: Source and destination are the same file\n");
+        return ERR_USAGE;
     }
-    
-    return 0;
-}
 
+    if (options.progress) {
+        progress_start();
+        if (!S_ISDIR(source_stat.st_mode))
+            progress_expect(source_stat.st_size);
+    }
+
+    enum move_error error;
+    if (S_ISDIR(source_stat.st_mode))
+        error = move_tree(source_path, dest_path, &options);
+    else
+        error = move_file(source_path, dest_path, &source_stat, &options);
+
+    progress_finish();
+    return error;
+}
@@ -0,0 +1,89 @@
+#ifndef MOVE_H
+#define MOVE_H
+
+#include <sys/stat.h>
+
+// Exit codes of the move utility
+enum move_error {
+    ERR_OK = 0,
+    ERR_USAGE = 1,
+    ERR_OPEN_SOURCE = 2,
+    ERR_OPEN_DEST = 3,
+    ERR_READ_SOURCE = 4,
+    ERR_WRITE_DEST = 5,
+    ERR_CLOSE_FILES = 6,
+    ERR_REMOVE_SOURCE = 7,
+    ERR_STAT_SOURCE = 9
+};
+
+// Copy strategies, fastest first. METHOD_AUTO tries rename() before all of
+// them; the others start the copy chain at the given method and fall back
+// to the next one when the kernel or filesystem does not support it.
+// METHOD_URING is only reached when asked for or when sendfile fails.
+enum copy_method {
+    METHOD_AUTO,
+    METHOD_CLONE,
+    METHOD_COPY_RANGE,
+    METHOD_SENDFILE,
+    METHOD_URING,
+    METHOD_RW
+};
+
+extern const char* const method_names[];
+
+enum copy_result {
+    COPY_DONE,
+    COPY_UNSUPPORTED,
+    COPY_READ_ERROR,
+    COPY_WRITE_ERROR
+};
+
+struct move_options {
+    enum copy_method method;
+    int verbose;
+    int jobs;          // worker threads for directory trees
+    int durable;       // everything is on disk before the source goes away
+    int progress;      // progress line and final summary on stderr
+};
+
+// copy_file flags
+#define COPY_METADATA 1 // owner, mode, xattrs and timestamps of the source
+#define COPY_FSYNC    2 // fsync the destination before closing it
+
+// Copy the regular file source_path to dest_path, creating or truncating
+// it. On failure prints a diagnostic, removes dest_path and returns the
+// exit code; the method that did the copy is stored in *used.
+enum move_error copy_file(const char* source_path, const char* dest_path,
+                          const struct stat* source_stat, enum copy_method method,
+                          int flags, enum copy_method* used);
+
+// Give dest_fd the owner, mode, extended attributes and timestamps of
+// source_fd. Ownership and attributes that cannot be set (not root, no
+// xattr support on the destination) are skipped; returns -1 only when the
+// mode or timestamps fail.
+int copy_metadata(int source_fd, int dest_fd, const struct stat* source_stat);
+
+// fsync a file or directory by name, or the directory holding path
+int sync_path(const char* path);
+int sync_parent(const char* path);
+
+// Copy source_fd to dest_fd with several reads and writes in flight on an
+// io_uring. Returns COPY_UNSUPPORTED if the kernel has no io_uring (or it
+// is blocked), so that the caller can use the read/write loop instead.
+enum copy_result copy_uring(int source_fd, int dest_fd, const struct stat* source_stat);
+
+// Progress reporting. progress_add is safe to call from any thread and
+// costs one atomic add; the line is redrawn by a separate thread started by
+// progress_start. progress_finish prints the summary if reporting was
+// started and does nothing otherwise.
+void progress_start(void);
+void progress_expect(off_t bytes);
+void progress_add(off_t bytes);
+void progress_finish(void);
+
+// Move the directory tree source_path to dest_path: a rename on the same
+// filesystem, otherwise a parallel copy followed by removal of the source
+enum move_error move_tree(const char* source_path, const char* dest_path,
+                          const struct move_options* options);
+
+#endif /* MOVE_H */
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "move.h"
+
+// How often the reporter thread redraws the progress line
+#define PROGRESS_INTERVAL_MS 500
+
+// Weight of the newest interval in the smoothed rate used for the ETA
+#define RATE_SMOOTHING 0.3
+
+// The copy loops only bump a counter; all clock reads and output happen
+// in the reporter thread, so the cost per chunk is one atomic add
+static struct {
+    off_t done;
+    off_t total;
+    int enabled;
+    int stop;
+    int tty;
+    struct timespec start;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} progress = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void format_bytes(char* out, size_t size, double bytes) {
+    static const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(out, size, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+}
+
+static void print_line(off_t done, off_t total, double rate) {
+    char done_text[32], total_text[32];
+    format_bytes(done_text, sizeof(done_text), done);
+    format_bytes(total_text, sizeof(total_text), total);
+
+    char eta[32] = "--:--";
+    if (rate > 0 && total > done) {
+        long left = (total - done) / rate;
+        if (left >= 3600)
+            snprintf(eta, sizeof(eta), "%ld:%02ld:%02ld", left / 3600, left / 60 % 60, left % 60);
+        else
+            snprintf(eta, sizeof(eta), "%02ld:%02ld", left / 60, left % 60);
+    }
+
+    int percent = total > 0 ? (int)(done * 100 / total) : 100;
+    fprintf(stderr, "%s%s / %s (%d%%)  %.1f MB/s  ETA %s%s", progress.tty ? "\r" : "",
+            done_text, total_text, percent, rate / 1048576, eta, progress.tty ? "\033[K" : "\n");
+}
+
+static void* reporter(void* arg) {
+    (void)arg;
+    struct timespec deadline;
+    off_t last_done = 0;
+    double last_time = 0;
+    double rate = 0;
+
+    pthread_mutex_lock(&progress.lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (!progress.stop) {
+        deadline.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        // A wakeup before the deadline is either the stop signal or
+        // spurious; the latter waits again for the same deadline
+        int err = 0;
+        while (!progress.stop && err != ETIMEDOUT)
+            err = pthread_cond_timedwait(&progress.wake, &progress.lock, &deadline);
+        if (progress.stop)
+            break;
+
+        off_t done = __atomic_load_n(&progress.done, __ATOMIC_RELAXED);
+        off_t total = __atomic_load_n(&progress.total, __ATOMIC_RELAXED);
+        double now = seconds_since(&progress.start);
+        double current = (done - last_done) / (now - last_time);
+        rate = last_time == 0 ? current : RATE_SMOOTHING * current + (1 - RATE_SMOOTHING) * rate;
+        last_done = done;
+        last_time = now;
+
+        print_line(done, total, rate);
+    }
+    pthread_mutex_unlock(&progress.lock);
+    return NULL;
+}
+
+void progress_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &progress.start);
+    progress.enabled = 1;
+    progress.tty = isatty(STDERR_FILENO);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress.wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Without the thread only the final summary is printed
+    if (pthread_create(&progress.thread, NULL, reporter, NULL) != 0)
+        progress.stop = 1;
+}
+
+void progress_expect(off_t bytes) {
+    __atomic_fetch_add(&progress.total, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_add(off_t bytes) {
+    __atomic_fetch_add(&progress.done, bytes, __ATOMIC_RELAXED);
+}
+
+// Wall time against CPU time tells whether the copy waited for the disks
+// (CPU much lower than wall) or was limited by copying in memory
+void progress_finish(void) {
+    if (!progress.enabled)
+        return;
+
+    pthread_mutex_lock(&progress.lock);
+    int running = !progress.stop;
+    progress.stop = 1;
+    pthread_cond_signal(&progress.wake);
+    pthread_mutex_unlock(&progress.lock);
+    if (running)
+        pthread_join(progress.thread, NULL);
+
+    double wall = seconds_since(&progress.start);
+    if (wall <= 0)
+        wall = 1e-9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    char done_text[32];
+    format_bytes(done_text, sizeof(done_text), progress.done);
+    if (progress.tty)
+        fprintf(stderr, "\r\033[K");
+    fprintf(stderr, "move: copied %s in %.2f s (%.1f MB/s), CPU %.2f s user + %.2f s sys (%.0f%% of wall)\n",
+            done_text, wall, progress.done / wall / 1048576, user, sys, (user + sys) * 100 / wall);
+}
@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "protect_audit.h"
+
+// Calls are counted in per-thread blocks that only their owner writes, so
+// counting never contends; the blocks are summed at exit. Log entries go
+// through a bounded lock-free ring and a writer thread does all the
+// formatting and write(2) calls, so an intercepted call never waits for
+// the log file or the terminal.
+
+// Ring slots; must be a power of two. A full ring drops new entries.
+#define RING_SIZE 1024
+
+// Longest path kept in a log entry; longer ones are cut
+#define PATH_SLOT 256
+
+// How often the writer thread drains the ring
+#define FLUSH_INTERVAL_MS 50
+
+static const char* const op_names[AUDIT_OPS] = {
+    "remove", "unlink", "unlinkat", "rmdir", "rename", "renameat", "renameat2",
+};
+
+struct thread_stats {
+    unsigned long allowed[AUDIT_OPS];
+    unsigned long blocked[AUDIT_OPS];
+    int in_use;                  // owned by a live thread
+    struct thread_stats* next;
+};
+
+struct entry {
+    size_t seq;                  // ring position this slot is ready for
+    struct timespec time;
+    pid_t tid;
+    unsigned char op;
+    unsigned char blocked;
+    char path[PATH_SLOT];
+    char path2[PATH_SLOT];
+};
+
+enum writer_state { WRITER_IDLE, WRITER_RUNNING, WRITER_FAILED, WRITER_STOPPED };
+
+// initial-exec: the library is preloaded, so its TLS is in the static block
+// and reaching it needs no __tls_get_addr call
+static __thread struct thread_stats* my_stats __attribute__((tls_model("initial-exec")));
+static __thread pid_t my_tid __attribute__((tls_model("initial-exec")));
+
+static struct thread_stats* all_stats;
+// Used when a block cannot be allocated; shared, so updated atomically
+static struct thread_stats fallback_stats;
+static pthread_key_t stats_key;
+static int have_stats_key;
+
+static struct {
+    struct entry* slots;
+    size_t head;                 // next position for producers
+    size_t tail;                 // next position for the writer
+    unsigned long dropped;
+    int fd;
+    int state;
+    pthread_t thread;
+    pthread_mutex_t lock;        // held by whoever drains the ring
+    pthread_cond_t wake;
+} ring = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pid_t pid;
+// Copy of stderr for the summary, or -1; programs like rm close stderr in
+// an atexit handler, before library destructors run
+static int stats_fd = -1;
+
+// A thread's block is released when it exits and reused by a later thread,
+// so the list stays as long as the most threads alive at once
+static void release_stats(void* block) {
+    __atomic_store_n(&((struct thread_stats*)block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static struct thread_stats* thread_stats(void) {
+    if (__builtin_expect(my_stats != NULL, 1))
+        return my_stats;
+
+    struct thread_stats* block;
+    for (block = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&block->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (block == NULL) {
+        block = calloc(1, sizeof(*block));
+        if (block == NULL)
+            return &fallback_stats;
+        block->in_use = 1;
+        block->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&all_stats, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    if (have_stats_key)
+        pthread_setspecific(stats_key, block);
+    my_stats = block;
+    return block;
+}
+
+static void count(unsigned long* counter, int shared) {
+    // Only the owner writes its block; the relaxed store keeps the summary
+    // from reading a torn value without paying for a locked add
+    if (shared)
+        __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+static void copy_path(char* out, const char* path) {
+    if (path == NULL) {
+        out[0] = '\0';
+        return;
+    }
+    size_t len = strnlen(path, PATH_SLOT - 1);
+    memcpy(out, path, len);
+    out[len] = '\0';
+}
+
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write out everything published so far and return how many entries that
+// was. Caller holds ring.lock, which makes it the only consumer.
+static size_t drain(void) {
+    char buf[65536];
+    size_t used = 0;
+    size_t start = ring.tail;
+
+    for (;;) {
+        struct entry* e = &ring.slots[ring.tail & (RING_SIZE - 1)];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != ring.tail + 1)
+            break;
+
+        if (used > sizeof(buf) - 2 * PATH_SLOT - 128) {
+            write_all(ring.fd, buf, used);
+            used = 0;
+        }
+        int n = snprintf(buf + used, sizeof(buf) - used, "[PROTECT] %d/%d %ld.%06ld %s %s %s%s%s\n",
+                         pid, e->tid, (long)e->time.tv_sec, e->time.tv_nsec / 1000, op_names[e->op],
+                         e->blocked ? "blocked" : "allowed", e->path,
+                         e->path2[0] != '\0' ? " -> " : "", e->path2);
+        used += n < (int)(sizeof(buf) - used) ? (size_t)n : sizeof(buf) - used - 1;
+
+        __atomic_store_n(&e->seq, ring.tail + RING_SIZE, __ATOMIC_RELEASE);
+        ring.tail++;
+    }
+    if (used > 0)
+        write_all(ring.fd, buf, used);
+    return ring.tail - start;
+}
+
+static void* writer(void* arg) {
+    (void)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&ring.lock);
+    while (__atomic_load_n(&ring.state, __ATOMIC_RELAXED) == WRITER_RUNNING) {
+        // Keep going without sleeping while a burst is filling the ring
+        if (drain() >= RING_SIZE / 4)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&ring.wake, &ring.lock, &deadline);
+    }
+    pthread_mutex_unlock(&ring.lock);
+    return NULL;
+}
+
+// The writer is started by the first logged call rather than by the
+// constructor, so processes that never delete anything get no extra thread
+static void start_writer(void) {
+    int idle = WRITER_IDLE;
+    if (!__atomic_compare_exchange_n(&ring.state, &idle, WRITER_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+
+    // Keep the writer from taking signals meant for the program
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&ring.thread, NULL, writer, NULL) != 0)
+        __atomic_store_n(&ring.state, WRITER_FAILED, __ATOMIC_RELAXED); // drained at exit
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void push(enum audit_op op, int blocked, const char* path, const char* path2) {
+    size_t pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+    struct entry* e;
+    for (;;) {
+        e = &ring.slots[pos & (RING_SIZE - 1)];
+        intptr_t diff = (intptr_t)(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (my_tid == 0)
+        my_tid = syscall(SYS_gettid);
+    clock_gettime(CLOCK_REALTIME, &e->time);
+    e->tid = my_tid;
+    e->op = op;
+    e->blocked = blocked;
+    copy_path(e->path, path);
+    copy_path(e->path2, path2);
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Wake the writer early in a burst instead of dropping entries until
+    // its next tick; signalling needs no lock and happens once per half ring
+    if ((pos & (RING_SIZE / 2 - 1)) == RING_SIZE / 2 - 1)
+        pthread_cond_signal(&ring.wake);
+}
+
+void audit_record(enum audit_op op, int blocked, const char* path, const char* path2) {
+    int saved_errno = errno;
+
+    struct thread_stats* stats = thread_stats();
+    count(blocked ? &stats->blocked[op] : &stats->allowed[op], stats == &fallback_stats);
+
+    if (ring.slots != NULL) {
+        int state = __atomic_load_n(&ring.state, __ATOMIC_RELAXED);
+        if (state == WRITER_IDLE)
+            start_writer();
+        push(op, blocked, path, path2);
+        // After the summary nobody drains the ring; write the entry here
+        if (state == WRITER_STOPPED && pthread_mutex_trylock(&ring.lock) == 0) {
+            drain();
+            pthread_mutex_unlock(&ring.lock);
+        }
+    }
+    errno = saved_errno;
+}
+
+int audit_logging(void) {
+    return ring.slots != NULL;
+}
+
+// Hold the drain lock over fork so the child does not inherit it locked
+static void before_fork(void) {
+    if (ring.slots != NULL)
+        pthread_mutex_lock(&ring.lock);
+}
+
+static void after_fork_parent(void) {
+    if (ring.slots != NULL)
+        pthread_mutex_unlock(&ring.lock);
+}
+
+// The child starts with its own counts and an empty ring: the parent
+// reports its calls and still owns the entries it queued. Only the forking
+// thread exists in the child, so every other block is free again.
+static void after_fork_child(void) {
+    pid = getpid();
+    my_tid = 0;
+    for (struct thread_stats* block = all_stats; block != NULL; block = block->next) {
+        memset(block->allowed, 0, sizeof(block->allowed));
+        memset(block->blocked, 0, sizeof(block->blocked));
+        block->in_use = block == my_stats;
+    }
+    memset(&fallback_stats, 0, sizeof(fallback_stats));
+
+    if (ring.slots == NULL)
+        return;
+    for (size_t i = 0; i < RING_SIZE; i++)
+        ring.slots[i].seq = i;
+    ring.head = ring.tail = 0;
+    ring.dropped = 0;
+    ring.state = WRITER_IDLE;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ring.wake, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void audit_init(void) {
+    pid = getpid();
+    const char* stats = getenv("PROTECT_STATS");
+    if (stats != NULL && *stats != '\0' && strcmp(stats, "0") != 0)
+        stats_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    have_stats_key = pthread_key_create(&stats_key, release_stats) == 0;
+
+    const char* log = getenv("PROTECT_LOG");
+    if (log != NULL && *log != '\0') {
+        if (strcmp(log, "-") == 0) {
+            ring.fd = stats_fd != -1 ? stats_fd : fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+            stats_fd = -1; // the summary goes to the log anyway
+        } else {
+            ring.fd = open(log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        }
+        if (ring.fd == -1)
+            fprintf(stderr, "[PROTECT] Cannot open log %s: %s\n", log, strerror(errno));
+        else if ((ring.slots = malloc(RING_SIZE * sizeof(*ring.slots))) != NULL) {
+            for (size_t i = 0; i < RING_SIZE; i++)
+                ring.slots[i].seq = i;
+
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&ring.wake, &attr);
+            pthread_condattr_destroy(&attr);
+        }
+    }
+
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+}
+
+static void add_counts(const struct thread_stats* block, unsigned long* allowed, unsigned long* blocked) {
+    for (int op = 0; op < AUDIT_OPS; op++) {
+        allowed[op] += __atomic_load_n(&block->allowed[op], __ATOMIC_RELAXED);
+        blocked[op] += __atomic_load_n(&block->blocked[op], __ATOMIC_RELAXED);
+    }
+}
+
+static void print_summary(int fd) {
+    unsigned long allowed[AUDIT_OPS] = {0}, blocked[AUDIT_OPS] = {0};
+    unsigned long total_allowed = 0, total_blocked = 0;
+
+    add_counts(&fallback_stats, allowed, blocked);
+    for (struct thread_stats* block = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); block != NULL; block = block->next)
+        add_counts(block, allowed, blocked);
+    for (int op = 0; op < AUDIT_OPS; op++) {
+        total_allowed += allowed[op];
+        total_blocked += blocked[op];
+    }
+    unsigned long dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+    if (total_allowed + total_blocked == 0)
+        return;
+
+    char buf[1024];
+    int used = snprintf(buf, sizeof(buf), "[PROTECT] %d summary: %lu allowed, %lu blocked", pid,
+                        total_allowed, total_blocked);
+    if (dropped > 0)
+        used += snprintf(buf + used, sizeof(buf) - used, ", %lu log entries dropped", dropped);
+    used += snprintf(buf + used, sizeof(buf) - used, "\n");
+    for (int op = 0; op < AUDIT_OPS; op++) {
+        if (allowed[op] + blocked[op] == 0)
+            continue;
+        used += snprintf(buf + used, sizeof(buf) - used, "[PROTECT] %d   %-9s %8lu allowed %8lu blocked\n",
+                         pid, op_names[op], allowed[op], blocked[op]);
+    }
+    write_all(fd, buf, used);
+}
+
+void audit_finish(void) {
+    if (ring.slots != NULL) {
+        pthread_mutex_lock(&ring.lock);
+        int state = __atomic_exchange_n(&ring.state, WRITER_STOPPED, __ATOMIC_ACQ_REL);
+        pthread_cond_signal(&ring.wake);
+        pthread_mutex_unlock(&ring.lock);
+        if (state == WRITER_RUNNING)
+            pthread_join(ring.thread, NULL);
+
+        pthread_mutex_lock(&ring.lock);
+        drain();
+        pthread_mutex_unlock(&ring.lock);
+        print_summary(ring.fd);
+    }
+    if (stats_fd != -1)
+        print_summary(stats_fd);
+}
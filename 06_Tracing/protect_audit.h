@@ -0,0 +1,40 @@
+#ifndef PROTECT_AUDIT_H
+#define PROTECT_AUDIT_H
+
+// Internal to libprotect: keep these out of the preloaded symbol table
+#pragma GCC visibility push(hidden)
+
+enum audit_op {
+    AUDIT_REMOVE,
+    AUDIT_UNLINK,
+    AUDIT_UNLINKAT,
+    AUDIT_RMDIR,
+    AUDIT_RENAME,
+    AUDIT_RENAMEAT,
+    AUDIT_RENAMEAT2,
+    AUDIT_OPS
+};
+
+// Read PROTECT_LOG and PROTECT_STATS and start the log writer if needed.
+// Called once from the library constructor.
+//
+//   PROTECT_LOG=FILE   append one line per intercepted call to FILE
+//                      ("-" for stderr); refusals go there instead of
+//                      being printed by the caller
+//   PROTECT_STATS=1    print the per-operation summary to stderr at exit
+//                      (it is always appended to the log)
+void audit_init(void);
+
+// Count a call and queue it for the log. Never blocks and never writes:
+// when the log ring is full the entry is dropped and counted as such.
+void audit_record(enum audit_op op, int blocked, const char* path, const char* path2);
+
+// Nonzero when refusals are reported through the log
+int audit_logging(void);
+
+// Flush the log and print the summary; called from the library destructor
+void audit_finish(void);
+
+#pragma GCC visibility pop
+
+#endif /* PROTECT_AUDIT_H */
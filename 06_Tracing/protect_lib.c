@@ -4,30 +4,166 @@
 #include <string.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "protect_audit.h"
+#include "protect_rules.h"
 
 typedef int (*remove_func_t)(const char *pathname);
 typedef int (*unlink_func_t)(const char *pathname);
+typedef int (*unlinkat_func_t)(int dirfd, const char *pathname, int flags);
+typedef int (*rmdir_func_t)(const char *pathname);
+typedef int (*rename_func_t)(const char *oldpath, const char *newpath);
+typedef int (*renameat_func_t)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath);
+typedef int (*renameat2_func_t)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+                                unsigned int flags);
 
-int remove(const char *pathname) {
-    remove_func_t original_remove = (remove_func_t)dlsym(RTLD_NEXT, "remove");
-    
-    if (pathname && strstr(pathname, "PROTECT") != NULL) {
-        fprintf(stderr, "[PROTECT] Prevented removal of protected file: %s\n", pathname);
-        errno = EPERM;
-        return -1;
+// The next definitions in the lookup order, resolved once. Wrappers only
+// test the pointer on the fast path; pthread_once covers calls made from
+// other libraries' constructors before ours has run.
+static remove_func_t original_remove;
+static unlink_func_t original_unlink;
+static unlinkat_func_t original_unlinkat;
+static rmdir_func_t original_rmdir;
+static rename_func_t original_rename;
+static renameat_func_t original_renameat;
+static renameat2_func_t original_renameat2;
+
+// Compiled from the file named by PROTECT_RULES, or the built-in rule
+static struct protect_rules *rules;
+
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+static void load_rules(void) {
+    const char *path = getenv("PROTECT_RULES");
+    if (path != NULL && *path != '\0') {
+        rules = rules_load(path);
+        if (rules != NULL)
+            return;
+        fprintf(stderr, "[PROTECT] Cannot load rules from %s, protecting paths containing PROTECT\n", path);
     }
-    
+    rules = rules_load(NULL);
+}
+
+static void resolve_symbols(void) {
+    original_remove = (remove_func_t)dlsym(RTLD_NEXT, "remove");
+    original_unlink = (unlink_func_t)dlsym(RTLD_NEXT, "unlink");
+    original_unlinkat = (unlinkat_func_t)dlsym(RTLD_NEXT, "unlinkat");
+    original_rmdir = (rmdir_func_t)dlsym(RTLD_NEXT, "rmdir");
+    original_rename = (rename_func_t)dlsym(RTLD_NEXT, "rename");
+    original_renameat = (renameat_func_t)dlsym(RTLD_NEXT, "renameat");
+    // glibc 2.28 and later
+    original_renameat2 = (renameat2_func_t)dlsym(RTLD_NEXT, "renameat2");
+    load_rules();
+    audit_init();
+}
+
+__attribute__((constructor))
+static void protect_init(void) {
+    pthread_once(&resolve_once, resolve_symbols);
+}
+
+__attribute__((destructor))
+static void protect_fini(void) {
+    audit_finish();
+}
+
+#define RESOLVE(func)                                     \
+    do {                                                  \
+        if (__builtin_expect(func == NULL, 0))            \
+            pthread_once(&resolve_once, resolve_symbols); \
+        if (func == NULL) {                               \
+            errno = ENOSYS;                               \
+            return -1;                                    \
+        }                                                 \
+    } while (0)
+
+static int is_protected(int dirfd, const char *pathname) {
+    if (rules == NULL) // out of memory while loading: keep the old behaviour
+        return pathname && strstr(pathname, "PROTECT") != NULL;
+    return rules_match(rules, dirfd, pathname);
+}
+
+// Renaming onto an existing protected file would replace it
+static int replaces_protected(int dirfd, const char *newpath) {
+    struct stat st;
+    return is_protected(dirfd, newpath) && fstatat(dirfd, newpath, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+// The call is logged with both of its paths; with PROTECT_LOG set the log
+// writer reports the refusal instead of the caller
+static int refuse(enum audit_op op, const char *action, const char *protected,
+                  const char *pathname, const char *newpath) {
+    audit_record(op, 1, pathname, newpath);
+    if (!audit_logging())
+        fprintf(stderr, "[PROTECT] Prevented %s of protected file: %s\n", action, protected);
+    errno = EPERM;
+    return -1;
+}
+
+int remove(const char *pathname) {
+    RESOLVE(original_remove);
+    if (is_protected(AT_FDCWD, pathname))
+        return refuse(AUDIT_REMOVE, "removal", pathname, pathname, NULL);
+    audit_record(AUDIT_REMOVE, 0, pathname, NULL);
     return original_remove(pathname);
 }
 
 int unlink(const char *pathname) {
-    unlink_func_t original_unlink = (unlink_func_t)dlsym(RTLD_NEXT, "unlink");
-    
-    if (pathname && strstr(pathname, "PROTECT") != NULL) {
-        fprintf(stderr, "[PROTECT] Prevented unlinking of protected file: %s\n", pathname);
-        errno = EPERM;
-        return -1;
-    }
-    
+    RESOLVE(original_unlink);
+    if (is_protected(AT_FDCWD, pathname))
+        return refuse(AUDIT_UNLINK, "unlinking", pathname, pathname, NULL);
+    audit_record(AUDIT_UNLINK, 0, pathname, NULL);
     return original_unlink(pathname);
 }
+
+int unlinkat(int dirfd, const char *pathname, int flags) {
+    RESOLVE(original_unlinkat);
+    if (is_protected(dirfd, pathname))
+        return refuse(AUDIT_UNLINKAT, "unlinking", pathname, pathname, NULL);
+    audit_record(AUDIT_UNLINKAT, 0, pathname, NULL);
+    return original_unlinkat(dirfd, pathname, flags);
+}
+
+int rmdir(const char *pathname) {
+    RESOLVE(original_rmdir);
+    if (is_protected(AT_FDCWD, pathname))
+        return refuse(AUDIT_RMDIR, "removal", pathname, pathname, NULL);
+    audit_record(AUDIT_RMDIR, 0, pathname, NULL);
+    return original_rmdir(pathname);
+}
+
+// Renaming a protected file away removes it from its place, and renaming
+// onto one replaces it, so both names are checked
+int rename(const char *oldpath, const char *newpath) {
+    RESOLVE(original_rename);
+    if (is_protected(AT_FDCWD, oldpath))
+        return refuse(AUDIT_RENAME, "renaming", oldpath, oldpath, newpath);
+    if (replaces_protected(AT_FDCWD, newpath))
+        return refuse(AUDIT_RENAME, "replacement", newpath, oldpath, newpath);
+    audit_record(AUDIT_RENAME, 0, oldpath, newpath);
+    return original_rename(oldpath, newpath);
+}
+
+int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath) {
+    RESOLVE(original_renameat);
+    if (is_protected(olddirfd, oldpath))
+        return refuse(AUDIT_RENAMEAT, "renaming", oldpath, oldpath, newpath);
+    if (replaces_protected(newdirfd, newpath))
+        return refuse(AUDIT_RENAMEAT, "replacement", newpath, oldpath, newpath);
+    audit_record(AUDIT_RENAMEAT, 0, oldpath, newpath);
+    return original_renameat(olddirfd, oldpath, newdirfd, newpath);
+}
+
+int renameat2(int olddirfd, const char *oldpath, int newdirfd, const char *newpath,
+              unsigned int flags) {
+    RESOLVE(original_renameat2);
+    if (is_protected(olddirfd, oldpath))
+        return refuse(AUDIT_RENAMEAT2, "renaming", oldpath, oldpath, newpath);
+    if (replaces_protected(newdirfd, newpath))
+        return refuse(AUDIT_RENAMEAT2, "replacement", newpath, oldpath, newpath);
+    audit_record(AUDIT_RENAMEAT2, 0, oldpath, newpath);
+    return original_renameat2(olddirfd, oldpath, newdirfd, newpath, flags);
+}
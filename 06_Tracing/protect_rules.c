@@ -0,0 +1,533 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "protect_rules.h"
+
+// Substring rules are matched together with an Aho-Corasick automaton and
+// prefix rules with a trie, so a path is scanned once whatever the number
+// of rules. Globs cannot be merged that way; the longest literal of each
+// glob goes into the automaton and fnmatch only runs for globs whose
+// literal occurs in the canonical path.
+
+// Trie node; children form a sibling list, which stays short for paths
+struct node {
+    int child;
+    int sibling;
+    int fail;          // longest proper suffix that is also in the trie
+    int dict;          // nearest node on the fail chain with outputs, -1 if none
+    int output;        // first output ending here, -1 if none
+    unsigned char c;
+    unsigned char terminal; // a prefix rule ends here
+};
+
+// What a match at a node means: a substring rule or a glob's literal
+struct output {
+    int glob;          // -1 for a substring rule
+    int next;
+};
+
+struct automaton {
+    struct node* nodes;
+    int count;
+    int capacity;
+};
+
+struct protect_rules {
+    struct automaton substrings;
+    struct automaton prefixes;
+    struct output* outputs;
+    int noutputs;
+    int nsubstrings;
+    char** globs;
+    unsigned char* glob_has_literal;
+    int nglobs;
+};
+
+static int node_new(struct automaton* a, unsigned char c) {
+    if (a->count == a->capacity) {
+        int capacity = a->capacity ? a->capacity * 2 : 64;
+        struct node* grown = realloc(a->nodes, capacity * sizeof(*grown));
+        if (grown == NULL)
+            return -1;
+        a->nodes = grown;
+        a->capacity = capacity;
+    }
+    struct node* n = &a->nodes[a->count];
+    n->child = -1;
+    n->sibling = -1;
+    n->fail = 0;
+    n->dict = -1;
+    n->output = -1;
+    n->c = c;
+    n->terminal = 0;
+    return a->count++;
+}
+
+static int find_child(const struct automaton* a, int node, unsigned char c) {
+    for (int i = a->nodes[node].child; i != -1; i = a->nodes[i].sibling)
+        if (a->nodes[i].c == c)
+            return i;
+    return -1;
+}
+
+// Returns the node at the end of text, or -1 when out of memory
+static int insert(struct automaton* a, const char* text, size_t len) {
+    int node = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        int next = find_child(a, node, c);
+        if (next == -1) {
+            next = node_new(a, c);
+            if (next == -1)
+                return -1;
+            a->nodes[next].sibling = a->nodes[node].child;
+            a->nodes[node].child = next;
+        }
+        node = next;
+    }
+    return node;
+}
+
+static int add_output(struct protect_rules* rules, int node, int glob) {
+    struct output* grown = realloc(rules->outputs, (rules->noutputs + 1) * sizeof(*grown));
+    if (grown == NULL)
+        return -1;
+    rules->outputs = grown;
+    rules->outputs[rules->noutputs].glob = glob;
+    rules->outputs[rules->noutputs].next = rules->substrings.nodes[node].output;
+    rules->substrings.nodes[node].output = rules->noutputs++;
+    return 0;
+}
+
+// Breadth-first, so that the fail target of a node is always finished
+static int build_links(struct automaton* a) {
+    int* queue = malloc(a->count * sizeof(int));
+    if (queue == NULL)
+        return -1;
+    int head = 0, tail = 0;
+
+    for (int i = a->nodes[0].child; i != -1; i = a->nodes[i].sibling)
+        queue[tail++] = i;
+    while (head < tail) {
+        int u = queue[head++];
+        for (int v = a->nodes[u].child; v != -1; v = a->nodes[v].sibling) {
+            int f = a->nodes[u].fail;
+            int target;
+            while ((target = find_child(a, f, a->nodes[v].c)) == -1 && f != 0)
+                f = a->nodes[f].fail;
+            a->nodes[v].fail = target == -1 ? 0 : target;
+
+            int fail = a->nodes[v].fail;
+            a->nodes[v].dict = a->nodes[fail].output != -1 ? fail : a->nodes[fail].dict;
+            queue[tail++] = v;
+        }
+    }
+
+    free(queue);
+    return 0;
+}
+
+// Longest run of characters in a glob that any match must contain
+static void glob_literal(const char* glob, const char** best, size_t* best_len) {
+    const char* run = glob;
+    *best = glob;
+    *best_len = 0;
+
+    for (const char* p = glob;; p++) {
+        int special = *p == '\0' || *p == '*' || *p == '?' || *p == '[' || *p == '\\';
+        if (!special)
+            continue;
+        if ((size_t)(p - run) > *best_len) {
+            *best = run;
+            *best_len = p - run;
+        }
+        if (*p == '\0')
+            break;
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '[') {
+            // Skip the bracket expression; ']' right after '[' or '[!' is literal
+            const char* q = p + 1;
+            if (*q == '!' || *q == '^')
+                q++;
+            if (*q == ']')
+                q++;
+            while (*q != '\0' && *q != ']')
+                q++;
+            if (*q == '\0')
+                break;
+            p = q;
+        }
+        run = p + 1;
+    }
+}
+
+// Collapse "//", "." and ".." in an absolute path, in place. Lexical only:
+// used where the directory cannot be resolved.
+static void normalize(char* path) {
+    size_t len = 1; // path[0] is '/'
+    const char* p = path;
+
+    while (*p != '\0') {
+        while (*p == '/')
+            p++;
+        const char* end = p;
+        while (*end != '\0' && *end != '/')
+            end++;
+        size_t n = end - p;
+
+        if (n == 0 || (n == 1 && p[0] == '.')) {
+            // nothing to add
+        } else if (n == 2 && p[0] == '.' && p[1] == '.') {
+            while (len > 1 && path[len - 1] != '/')
+                len--;
+            if (len > 1)
+                len--;
+        } else {
+            if (len > 1)
+                path[len++] = '/';
+            memmove(path + len, p, n);
+            len += n;
+        }
+        p = end;
+    }
+    path[len] = '\0';
+}
+
+// The directory dirfd stands for, as an absolute path
+static int base_path(int dirfd, char* base) {
+    if (dirfd == AT_FDCWD)
+        return getcwd(base, PATH_MAX) != NULL && base[0] == '/' ? 0 : -1;
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+    ssize_t len = readlink(link, base, PATH_MAX - 1);
+    if (len == -1)
+        return -1;
+    base[len] = '\0';
+    return base[0] == '/' ? 0 : -1;
+}
+
+// pathname joined to its base and normalized. Without a base (no cwd, no
+// /proc) or when the result would be too long, pathname is used as given.
+static void lexical_path(int dirfd, const char* pathname, char* out) {
+    char base[PATH_MAX];
+    int n = -1;
+    if (pathname[0] == '/')
+        n = snprintf(out, PATH_MAX, "%s", pathname);
+    else if (base_path(dirfd, base) == 0)
+        n = snprintf(out, PATH_MAX, "%s/%s", base, pathname);
+    if (n < 0 || n >= PATH_MAX) {
+        snprintf(out, PATH_MAX, "%s", pathname);
+        return;
+    }
+    normalize(out);
+}
+
+// Canonical directories this thread resolved last, keyed by inode. A hit
+// costs one stat() of the cached path to make sure the directory was not
+// moved since, instead of a realpath() per component.
+#define DIR_CACHE_SIZE 4
+
+struct dir_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    char path[PATH_MAX];  // empty when unused
+};
+
+static __thread struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+static __thread unsigned dir_cache_next;
+
+static const char* dir_cache_find(const struct stat* st) {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        struct dir_cache_entry* e = &dir_cache[i];
+        if (e->path[0] == '\0' || e->dev != st->st_dev || e->ino != st->st_ino)
+            continue;
+        struct stat now;
+        if (stat(e->path, &now) == 0 && now.st_dev == e->dev && now.st_ino == e->ino)
+            return e->path;
+        e->path[0] = '\0';
+        return NULL;
+    }
+    return NULL;
+}
+
+static void dir_cache_add(const struct stat* st, const char* path) {
+    struct dir_cache_entry* e = &dir_cache[dir_cache_next++ % DIR_CACHE_SIZE];
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    memcpy(e->path, path, strlen(path) + 1);
+}
+
+// The path the kernel would delete for pathname relative to dirfd: the
+// parent directory through realpath, so symlinks, "." and ".." cannot hide
+// a protected location, plus the last component. When the parent cannot be
+// resolved (it does not exist, or there is no cwd or /proc to start from)
+// the lexical form is used instead.
+static void canonical_path(int dirfd, const char* pathname, char* out) {
+    char dir[PATH_MAX];
+    size_t len = strlen(pathname);
+    while (len > 1 && pathname[len - 1] == '/')
+        len--;
+    if (len >= sizeof(dir)) {
+        lexical_path(dirfd, pathname, out);
+        return;
+    }
+    memcpy(dir, pathname, len);
+    dir[len] = '\0';
+
+    // Split off the last component; "." and ".." name the directory itself
+    const char* parent = ".";
+    const char* last = dir;
+    char* slash = strrchr(dir, '/');
+    if (slash != NULL) {
+        last = slash + 1;
+        parent = slash == dir ? "/" : dir;
+    }
+    if (strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+        parent = dir;
+        last = NULL;
+    } else if (slash != NULL && slash != dir) {
+        *slash = '\0';
+    }
+
+    struct stat st;
+    if (fstatat(dirfd, parent, &st, 0) == -1) {
+        lexical_path(dirfd, pathname, out);
+        return;
+    }
+    char resolved[PATH_MAX];
+    const char* cached = dir_cache_find(&st);
+    if (cached != NULL) {
+        memcpy(resolved, cached, strlen(cached) + 1);
+    } else {
+        char joined[PATH_MAX];
+        char base[PATH_MAX];
+        int n = -1;
+        if (parent[0] == '/')
+            n = snprintf(joined, sizeof(joined), "%s", parent);
+        else if (base_path(dirfd, base) == 0)
+            n = snprintf(joined, sizeof(joined), "%s/%s", base, parent);
+        if (n < 0 || n >= (int)sizeof(joined) || realpath(joined, resolved) == NULL) {
+            lexical_path(dirfd, pathname, out);
+            return;
+        }
+        dir_cache_add(&st, resolved);
+    }
+
+    if (last == NULL) {
+        memcpy(out, resolved, strlen(resolved) + 1);
+    } else {
+        int n = snprintf(out, PATH_MAX, "%s%s%s", resolved, strcmp(resolved, "/") == 0 ? "" : "/", last);
+        if (n < 0 || n >= PATH_MAX)
+            lexical_path(dirfd, pathname, out);
+    }
+}
+
+static int add_rule(struct protect_rules* rules, const char* line) {
+    if (strncmp(line, "prefix:", 7) == 0) {
+        line += 7;
+        if (*line == '\0')
+            return 0;
+        // Paths are matched in canonical form, so the rule is put in it too,
+        // a relative one resolved against the cwd at load time; a trailing
+        // '/' is kept, as it limits the rule to what is below
+        char canonical[PATH_MAX];
+        size_t len = strlen(line);
+        if (len < sizeof(canonical) && realpath(line, canonical) == NULL)
+            lexical_path(AT_FDCWD, line, canonical);
+        if (len >= sizeof(canonical) || canonical[0] != '/') {
+            fprintf(stderr, "[PROTECT] Ignoring prefix:%s, it cannot be made absolute\n", line);
+            return 0;
+        }
+        size_t n = strlen(canonical);
+        if (line[len - 1] == '/' && canonical[n - 1] != '/' && n + 1 < sizeof(canonical)) {
+            canonical[n] = '/';
+            canonical[n + 1] = '\0';
+        }
+        line = canonical;
+        int node = insert(&rules->prefixes, line, strlen(line));
+        if (node == -1)
+            return -1;
+        rules->prefixes.nodes[node].terminal = 1;
+        return 0;
+    }
+
+    int glob = -1;
+    const char* literal = line;
+    size_t literal_len;
+    if (strncmp(line, "glob:", 5) == 0) {
+        line += 5;
+        if (*line == '\0')
+            return 0;
+        char** globs = realloc(rules->globs, (rules->nglobs + 1) * sizeof(char*));
+        unsigned char* flags = globs ? realloc(rules->glob_has_literal, rules->nglobs + 1) : NULL;
+        if (globs != NULL)
+            rules->globs = globs;
+        if (flags == NULL)
+            return -1;
+        rules->glob_has_literal = flags;
+        if ((rules->globs[rules->nglobs] = strdup(line)) == NULL)
+            return -1;
+        glob = rules->nglobs++;
+        glob_literal(line, &literal, &literal_len);
+        rules->glob_has_literal[glob] = literal_len > 0;
+        if (literal_len == 0)
+            return 0; // checked against every path
+    } else {
+        if (strncmp(line, "substr:", 7) == 0)
+            line += 7;
+        literal = line;
+        literal_len = strlen(line);
+        if (literal_len == 0)
+            return 0;
+        rules->nsubstrings++;
+    }
+
+    int node = insert(&rules->substrings, literal, literal_len);
+    return node == -1 ? -1 : add_output(rules, node, glob);
+}
+
+struct protect_rules* rules_load(const char* path) {
+    struct protect_rules* rules = calloc(1, sizeof(*rules));
+    if (rules == NULL || node_new(&rules->substrings, 0) == -1 || node_new(&rules->prefixes, 0) == -1) {
+        rules_free(rules);
+        return NULL;
+    }
+
+    if (path == NULL) {
+        if (add_rule(rules, "substr:PROTECT") == -1) {
+            rules_free(rules);
+            return NULL;
+        }
+    } else {
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            rules_free(rules);
+            return NULL;
+        }
+
+        char* line = NULL;
+        size_t capacity = 0;
+        ssize_t len;
+        int failed = 0;
+        while (!failed && (len = getline(&line, &capacity, file)) != -1) {
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                line[--len] = '\0';
+            if (len == 0 || line[0] == '#')
+                continue;
+            failed = add_rule(rules, line) == -1;
+        }
+        free(line);
+        fclose(file);
+        if (failed) {
+            rules_free(rules);
+            return NULL;
+        }
+    }
+
+    if (build_links(&rules->substrings) == -1) {
+        rules_free(rules);
+        return NULL;
+    }
+    return rules;
+}
+
+// A prefix only counts at a component boundary: prefix:/tmp/pdata covers
+// /tmp/pdata and /tmp/pdata/x but not /tmp/pdatabase
+static int match_prefix(const struct automaton* a, const char* path) {
+    int node = 0;
+    for (const char* p = path; *p != '\0'; p++) {
+        node = find_child(a, node, (unsigned char)*p);
+        if (node == -1)
+            return 0;
+        if (a->nodes[node].terminal && (*p == '/' || p[1] == '/' || p[1] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+// Run the automaton over text. With candidates NULL, returns nonzero when
+// a substring rule occurs; otherwise only marks the globs whose literal does.
+static int scan(const struct protect_rules* rules, const char* text, unsigned char* candidates) {
+    const struct automaton* a = &rules->substrings;
+    int state = 0;
+    for (const char* p = text; *p != '\0'; p++) {
+        unsigned char c = *p;
+        int next;
+        while ((next = find_child(a, state, c)) == -1 && state != 0)
+            state = a->nodes[state].fail;
+        state = next == -1 ? 0 : next;
+
+        int n = a->nodes[state].output != -1 ? state : a->nodes[state].dict;
+        for (; n != -1; n = a->nodes[n].dict) {
+            for (int o = a->nodes[n].output; o != -1; o = rules->outputs[o].next) {
+                int glob = rules->outputs[o].glob;
+                if (candidates == NULL && glob == -1)
+                    return 1;
+                if (candidates != NULL && glob != -1)
+                    candidates[glob] = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int rules_match(const struct protect_rules* rules, int dirfd, const char* pathname) {
+    // Nothing to delete; the call fails on its own
+    if (pathname == NULL || *pathname == '\0')
+        return 0;
+
+    // Substring rules see the name as the caller passed it, which needs no
+    // system call
+    if (rules->nsubstrings > 0 && scan(rules, pathname, NULL))
+        return 1;
+    if (rules->nglobs == 0 && rules->prefixes.nodes[0].child == -1)
+        return 0;
+
+    // Globs and prefixes see the canonical path, however the caller named it
+    char canonical[PATH_MAX];
+    canonical_path(dirfd, pathname, canonical);
+
+    unsigned char small[256];
+    unsigned char* candidates = small;
+    if (rules->nglobs > (int)sizeof(small) && (candidates = calloc(rules->nglobs, 1)) == NULL)
+        candidates = NULL; // check every glob instead
+    else if (candidates == small)
+        memset(small, 0, sizeof(small));
+    if (candidates != NULL && rules->nglobs > 0)
+        scan(rules, canonical, candidates);
+
+    int matched = 0;
+    for (int g = 0; g < rules->nglobs && !matched; g++) {
+        if (candidates != NULL && rules->glob_has_literal[g] && !candidates[g])
+            continue;
+        matched = fnmatch(rules->globs[g], canonical, 0) == 0;
+    }
+    if (candidates != small)
+        free(candidates);
+
+    if (!matched)
+        matched = match_prefix(&rules->prefixes, canonical);
+    return matched;
+}
+
+void rules_free(struct protect_rules* rules) {
+    if (rules == NULL)
+        return;
+    for (int g = 0; g < rules->nglobs; g++)
+        free(rules->globs[g]);
+    free(rules->globs);
+    free(rules->glob_has_literal);
+    free(rules->outputs);
+    free(rules->substrings.nodes);
+    free(rules->prefixes.nodes);
+    free(rules);
+}
@@ -0,0 +1,35 @@
+#ifndef PROTECT_RULES_H
+#define PROTECT_RULES_H
+
+// Internal to libprotect: keep these out of the preloaded symbol table
+#pragma GCC visibility push(hidden)
+
+// A compiled set of protection rules. The rules file has one rule per line:
+//
+//   substr:TEXT    the pathname as passed contains TEXT (a line without a
+//                  prefix means the same)
+//   prefix:PATH    path is PATH or below it; with a trailing '/', only below.
+//                  A relative PATH is taken from the cwd at load time.
+//   glob:PATTERN   fnmatch(PATTERN, path) with '*' also matching '/'
+//
+// Blank lines and lines starting with '#' are ignored. Prefix and glob
+// rules are matched against the canonical absolute path: its directory
+// resolved with realpath, whatever mix of dirfd, relative path, "//", "."
+// or ".." the caller used. When the directory cannot be resolved (it does
+// not exist, or there is no cwd or /proc to start from) they see the path
+// with "." and ".." collapsed lexically instead; the call is not blocked
+// for that alone.
+struct protect_rules;
+
+// Compile the rules in path, or the built-in "substr:PROTECT" if path is
+// NULL. Returns NULL if the file cannot be read.
+struct protect_rules* rules_load(const char* path);
+
+// Nonzero if pathname (relative to dirfd) is protected
+int rules_match(const struct protect_rules* rules, int dirfd, const char* pathname);
+
+void rules_free(struct protect_rules* rules);
+
+#pragma GCC visibility pop
+
+#endif /* PROTECT_RULES_H */
@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "move.h"
+
+// From this many files on, one syncfs() of the destination filesystem is
+// cheaper than an fsync() per file and directory, even though it also
+// flushes data written by others
+#define SYNCFS_MIN_FILES 64
+
+// One node of the source tree. Entries are kept in pre-order, so walking
+// the array backwards visits children before their parent directory.
+struct tree_entry {
+    char* source;
+    char* dest;
+    struct stat st;
+    int created;   // dest was created by us and is removed on failure
+};
+
+struct tree {
+    struct tree_entry* entries;
+    size_t count;
+    size_t capacity;
+    size_t files;
+    size_t dirs;
+    off_t bytes;       // total size of the regular files
+};
+
+// Work queue for the copy threads: each takes the next regular file
+struct copy_queue {
+    struct tree* tree;
+    const struct move_options* options;
+    int flags;         // copy_file flags
+    pthread_mutex_t lock;
+    size_t next;
+    enum move_error error;
+};
+
+static char* join_path(const char* dir, const char* name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = malloc(dir_len + name_len + 2);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+// Takes ownership of source and dest
+static int add_entry(struct tree* tree, char* source, char* dest, const struct stat* st) {
+    if (tree->count == tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+        struct tree_entry* grown = realloc(tree->entries, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            free(source);
+            free(dest);
+            return -1;
+        }
+        tree->entries = grown;
+        tree->capacity = capacity;
+    }
+
+    struct tree_entry* entry = &tree->entries[tree->count++];
+    entry->source = source;
+    entry->dest = dest;
+    entry->st = *st;
+    entry->created = 0;
+    if (S_ISREG(st->st_mode)) {
+        tree->files++;
+        tree->bytes += st->st_size;
+    }
+    else if (S_ISDIR(st->st_mode))
+        tree->dirs++;
+    return 0;
+}
+
+static void free_tree(struct tree* tree) {
+    for (size_t i = 0; i < tree->count; i++) {
+        free(tree->entries[i].source);
+        free(tree->entries[i].dest);
+    }
+    free(tree->entries);
+}
+
+// Append everything below the directory entry at index. Hard links are not
+// tracked: each name becomes its own copy.
+static enum move_error scan_dir(struct tree* tree, size_t index) {
+    // Entries may move when the array grows; the strings do not
+    const char* source = tree->entries[index].source;
+    const char* dest = tree->entries[index].dest;
+
+    DIR* dir = opendir(source);
+    if (dir == NULL) {
+        fprintf(stderr, "Error: Cannot open source directory %s - %s\n", source, strerror(errno));
+        return ERR_OPEN_SOURCE;
+    }
+
+    enum move_error error = ERR_OK;
+    struct dirent* de;
+    while (error == ERR_OK && (errno = 0, de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        char* child_source = join_path(source, de->d_name);
+        char* child_dest = join_path(dest, de->d_name);
+        struct stat st;
+        if (child_source == NULL || child_dest == NULL) {
+            free(child_source);
+            free(child_dest);
+            fprintf(stderr, "Error: Out of memory\n");
+            error = ERR_READ_SOURCE;
+        } else if (lstat(child_source, &st) == -1) {
+            fprintf(stderr, "Error: Cannot stat source file %s - %s\n", child_source, strerror(errno));
+            free(child_source);
+            free(child_dest);
+            error = ERR_STAT_SOURCE;
+        } else if (add_entry(tree, child_source, child_dest, &st) == -1) {
+            fprintf(stderr, "Error: Out of memory\n");
+            error = ERR_READ_SOURCE;
+        } else if (S_ISDIR(st.st_mode)) {
+            error = scan_dir(tree, tree->count - 1);
+        }
+    }
+    if (error == ERR_OK && errno != 0) {
+        fprintf(stderr, "Error: Failed to read source directory %s - %s\n", source, strerror(errno));
+        error = ERR_READ_SOURCE;
+    }
+
+    closedir(dir);
+    return error;
+}
+
+// Owner, mode and timestamps of a node that cannot be opened (symlinks,
+// devices, sockets)
+static void copy_path_metadata(const struct tree_entry* entry) {
+    const struct stat* st = &entry->st;
+    int followed = S_ISLNK(st->st_mode) ? AT_SYMLINK_NOFOLLOW : 0;
+
+    fchownat(AT_FDCWD, entry->dest, st->st_uid, st->st_gid, followed);
+    if (!S_ISLNK(st->st_mode))
+        chmod(entry->dest, st->st_mode & 07777);
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    utimensat(AT_FDCWD, entry->dest, times, followed);
+}
+
+// Create every directory and non-regular node of the destination. The
+// directories stay owner-writable until their contents are in place.
+static enum move_error create_skeleton(struct tree* tree) {
+    for (size_t i = 0; i < tree->count; i++) {
+        struct tree_entry* entry = &tree->entries[i];
+        mode_t mode = entry->st.st_mode;
+        int result = 0;
+
+        if (S_ISREG(mode)) {
+            continue;
+        } else if (S_ISDIR(mode)) {
+            result = mkdir(entry->dest, 0700);
+        } else if (S_ISLNK(mode)) {
+            char* target = malloc(entry->st.st_size + 1);
+            ssize_t len = target ? readlink(entry->source, target, entry->st.st_size + 1) : -1;
+            if (len < 0 || len > entry->st.st_size) {
+                fprintf(stderr, "Error: Cannot read symbolic link %s - %s\n", entry->source,
+                        strerror(len < 0 ? errno : ENAMETOOLONG));
+                free(target);
+                return ERR_READ_SOURCE;
+            }
+            target[len] = '\0';
+            result = symlink(target, entry->dest);
+            free(target);
+        } else {
+            result = mknod(entry->dest, mode, entry->st.st_rdev);
+        }
+
+        if (result == -1) {
+            fprintf(stderr, "Error: Cannot create %s - %s\n", entry->dest, strerror(errno));
+            return ERR_OPEN_DEST;
+        }
+        entry->created = 1;
+        if (!S_ISDIR(mode))
+            copy_path_metadata(entry);
+    }
+    return ERR_OK;
+}
+
+static void* copy_worker(void* arg) {
+    struct copy_queue* q = arg;
+    struct tree* tree = q->tree;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->next < tree->count && !S_ISREG(tree->entries[q->next].st.st_mode))
+            q->next++;
+        size_t i = q->next < tree->count ? q->next++ : tree->count;
+        pthread_mutex_unlock(&q->lock);
+        if (i == tree->count)
+            break;
+
+        struct tree_entry* entry = &tree->entries[i];
+        enum copy_method used;
+        enum move_error error = copy_file(entry->source, entry->dest, &entry->st, q->options->method,
+                                          q->flags, &used);
+        if (error == ERR_OK) {
+            entry->created = 1;
+            continue;
+        }
+
+        // Stop handing out files; the first error decides the exit code
+        pthread_mutex_lock(&q->lock);
+        fprintf(stderr, "Error: Failed to copy %s\n", entry->source);
+        if (q->error == ERR_OK)
+            q->error = error;
+        q->next = tree->count;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return NULL;
+}
+
+static enum move_error copy_files(struct tree* tree, const struct move_options* options,
+                                  int batch_sync) {
+    struct copy_queue q = {
+        .tree = tree,
+        .options = options,
+        .flags = COPY_METADATA | (batch_sync ? 0 : COPY_FSYNC),
+        .next = 0,
+        .error = ERR_OK,
+    };
+    pthread_mutex_init(&q.lock, NULL);
+
+    size_t nthreads = options->jobs;
+    if (nthreads > tree->files)
+        nthreads = tree->files;
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    size_t started = 0;
+    for (; threads != NULL && started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, copy_worker, &q) != 0)
+            break;
+    }
+    if (started == 0) {
+        // Could not spawn anything: do the work here
+        copy_worker(&q);
+    }
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&q.lock);
+    return q.error;
+}
+
+static int sync_filesystem(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    int result = syncfs(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return result;
+}
+
+// Apply the source metadata to the destination directories, deepest first
+// so that setting a timestamp is not undone by changes to the contents,
+// and make the new entries durable: each directory is synced, or the whole
+// filesystem at once when the files were not synced one by one either
+static enum move_error finish_dirs(struct tree* tree, int batch_sync) {
+    for (size_t i = tree->count; i-- > 0;) {
+        struct tree_entry* entry = &tree->entries[i];
+        if (!S_ISDIR(entry->st.st_mode))
+            continue;
+
+        int source_fd = open(entry->source, O_RDONLY | O_DIRECTORY);
+        int dest_fd = open(entry->dest, O_RDONLY | O_DIRECTORY);
+        int result = source_fd == -1 || dest_fd == -1 ? -1 : copy_metadata(source_fd, dest_fd, &entry->st);
+        if (result == 0 && !batch_sync)
+            result = fsync(dest_fd);
+        int err = errno;
+        if (source_fd != -1)
+            close(source_fd);
+        if (dest_fd != -1)
+            close(dest_fd);
+        if (result == -1) {
+            fprintf(stderr, "Error: Cannot finish directory %s - %s\n", entry->dest, strerror(err));
+            return ERR_WRITE_DEST;
+        }
+    }
+
+    if (batch_sync && sync_filesystem(tree->entries[0].dest) == -1) {
+        fprintf(stderr, "Error: Failed to sync destination filesystem - %s\n", strerror(errno));
+        return ERR_WRITE_DEST;
+    }
+
+    // The new top-level entry lives in the parent of the destination
+    if (sync_parent(tree->entries[0].dest) == -1) {
+        fprintf(stderr, "Error: Failed to sync destination directory - %s\n", strerror(errno));
+        return ERR_WRITE_DEST;
+    }
+    return ERR_OK;
+}
+
+// Undo a failed copy: remove what was created, children first
+static void remove_dest(struct tree* tree) {
+    for (size_t i = tree->count; i-- > 0;) {
+        struct tree_entry* entry = &tree->entries[i];
+        if (!entry->created)
+            continue;
+        if (S_ISDIR(entry->st.st_mode))
+            rmdir(entry->dest);
+        else
+            unlink(entry->dest);
+    }
+}
+
+static enum move_error remove_source(struct tree* tree) {
+    for (size_t i = tree->count; i-- > 0;) {
+        struct tree_entry* entry = &tree->entries[i];
+        int result = S_ISDIR(entry->st.st_mode) ? rmdir(entry->source) : unlink(entry->source);
+        if (result == -1) {
+            fprintf(stderr, "Error: Failed to remove source file %s - %s\n", entry->source,
+                    strerror(errno));
+            return ERR_REMOVE_SOURCE;
+        }
+    }
+    return ERR_OK;
+}
+
+// Whether dest would end up inside the source tree. Like mv(1), the real
+// path of the destination's parent is compared with that of the source;
+// when either cannot be resolved the copy itself reports the error.
+static int dest_inside_source(const char* source_path, const char* dest_path) {
+    char source[PATH_MAX];
+    char parent[PATH_MAX];
+    char* copy = strdup(dest_path);
+    if (copy == NULL)
+        return 0;
+    int resolved = realpath(source_path, source) != NULL && realpath(dirname(copy), parent) != NULL;
+    free(copy);
+    if (!resolved)
+        return 0;
+    size_t len = strlen(source);
+    if (len == 1)
+        return 1;  // everything is below /
+    return strncmp(parent, source, len) == 0 && (parent[len] == '/' || parent[len] == '\0');
+}
+
+enum move_error move_tree(const char* source_path, const char* dest_path,
+                          const struct move_options* options) {
+    if (dest_inside_source(source_path, dest_path)) {
+        fprintf(stderr, "Error: Cannot move %s into itself\n", source_path);
+        return ERR_USAGE;
+    }
+
+    // Same filesystem: the whole tree moves with one directory entry. For a
+    // durable move the data in the tree is flushed first in one batch.
+    if (options->method == METHOD_AUTO) {
+        if (options->durable && sync_filesystem(source_path) == -1) {
+            fprintf(stderr, "Error: Failed to sync source filesystem - %s\n", strerror(errno));
+            return ERR_READ_SOURCE;
+        }
+        if (rename(source_path, dest_path) == 0) {
+            if (options->durable && (sync_parent(dest_path) == -1 || sync_parent(source_path) == -1)) {
+                fprintf(stderr, "Error: Failed to sync directory - %s\n", strerror(errno));
+                return ERR_WRITE_DEST;
+            }
+            if (options->verbose)
+                fprintf(stderr, "%s -> %s (rename)\n", source_path, dest_path);
+            return ERR_OK;
+        }
+        if (errno != EXDEV) {
+            fprintf(stderr, "Error: Cannot move directory - %s\n", strerror(errno));
+            return ERR_OPEN_DEST;
+        }
+    }
+
+    struct stat st;
+    if (lstat(dest_path, &st) == 0) {
+        fprintf(stderr, "Error: Destination %s already exists\n", dest_path);
+        return ERR_OPEN_DEST;
+    }
+    if (lstat(source_path, &st) == -1) {
+        fprintf(stderr, "Error: Cannot stat source file - %s\n", strerror(errno));
+        return ERR_STAT_SOURCE;
+    }
+
+    struct tree tree = {0};
+    char* source = strdup(source_path);
+    char* dest = strdup(dest_path);
+    if (source == NULL || dest == NULL || add_entry(&tree, source, dest, &st) == -1) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free_tree(&tree);
+        return ERR_READ_SOURCE;
+    }
+
+    // The source is only removed once every file and directory of the
+    // copy has been synced
+    enum move_error error = scan_dir(&tree, 0);
+    int batch_sync = tree.files >= SYNCFS_MIN_FILES;
+    progress_expect(tree.bytes);
+    if (error == ERR_OK)
+        error = create_skeleton(&tree);
+    if (error == ERR_OK)
+        error = copy_files(&tree, options, batch_sync);
+    if (error == ERR_OK)
+        error = finish_dirs(&tree, batch_sync);
+
+    if (error != ERR_OK) {
+        remove_dest(&tree);
+    } else {
+        error = remove_source(&tree);
+        if (error == ERR_OK && options->durable && sync_parent(source_path) == -1) {
+            fprintf(stderr, "Error: Failed to sync source directory - %s\n", strerror(errno));
+            error = ERR_REMOVE_SOURCE;
+        }
+    }
+
+    if (error == ERR_OK && options->verbose)
+        fprintf(stderr, "%s -> %s (%zu files, %zu directories, %d jobs, %s)\n", source_path,
+                dest_path, tree.files, tree.dirs, options->jobs, batch_sync ? "syncfs" : "fsync");
+
+    free_tree(&tree);
+    return error;
+}
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "move.h"
+
+// Reads and writes in flight; each slot owns one registered buffer
+#define URING_SLOTS 8
+#define URING_BUFFER_SIZE (1L << 20)
+
+// The kernel interface is used directly (no liburing): three syscalls and
+// two shared rings
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned queued;   // SQEs filled in but not yet passed to the kernel
+};
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_READING,
+    SLOT_WRITING
+};
+
+// A buffer-sized piece of the file on its way from source to destination
+struct slot {
+    enum slot_state state;
+    char* buffer;
+    off_t offset;
+    size_t len;        // bytes wanted (reading) or held (writing)
+    size_t done;       // bytes read or written so far
+};
+
+static int uring_init(struct uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+static void uring_free(struct uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Queue one read or write of a slot; the ring has room for all slots, so
+// this cannot run out of SQEs
+static void uring_queue(struct uring* ring, int opcode, int fd, struct slot* slot,
+                        unsigned index, int fixed) {
+    unsigned tail = *ring->sq_tail;
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)(slot->buffer + slot->done);
+    sqe->len = slot->len - slot->done;
+    sqe->off = slot->offset + slot->done;
+    sqe->user_data = index;
+    if (fixed)
+        sqe->buf_index = index;
+
+    ring->sq_array[i] = i;
+    // The kernel may read the SQE as soon as it sees the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+// Submit everything queued and wait for at least one completion
+static int uring_submit_and_wait(struct uring* ring) {
+    for (;;) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS,
+                        NULL, 0);
+        if (n >= 0) {
+            ring->queued -= n;
+            return 0;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+static void queue_read(struct uring* ring, int source_fd, struct slot* slots, unsigned index,
+                       off_t offset, size_t len, int fixed) {
+    struct slot* slot = &slots[index];
+    slot->state = SLOT_READING;
+    slot->offset = offset;
+    slot->len = len;
+    slot->done = 0;
+    uring_queue(ring, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, source_fd, slot, index, fixed);
+}
+
+// One ring and one set of registered buffers per thread, reused for every
+// file: setting them up costs more than copying a small file
+struct uring_context {
+    struct uring ring;
+    char* buffers;
+    int fixed;         // buffers are registered, use READ_FIXED/WRITE_FIXED
+    int failed;        // no io_uring for this thread
+};
+
+static pthread_key_t context_key;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+
+static void free_context(void* arg) {
+    struct uring_context* ctx = arg;
+    if (!ctx->failed) {
+        uring_free(&ctx->ring);
+        free(ctx->buffers);
+    }
+    free(ctx);
+}
+
+static void create_context_key(void) {
+    pthread_key_create(&context_key, free_context);
+}
+
+static struct uring_context* get_context(void) {
+    pthread_once(&context_once, create_context_key);
+    struct uring_context* ctx = pthread_getspecific(context_key);
+    if (ctx != NULL)
+        return ctx->failed ? NULL : ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+    pthread_setspecific(context_key, ctx);
+
+    if (uring_init(&ctx->ring, URING_SLOTS) == -1) {
+        ctx->failed = 1;
+        return NULL;
+    }
+    if (posix_memalign((void**)&ctx->buffers, sysconf(_SC_PAGESIZE), URING_SLOTS * URING_BUFFER_SIZE) != 0) {
+        uring_free(&ctx->ring);
+        ctx->failed = 1;
+        return NULL;
+    }
+
+    // Registered buffers spare the kernel from pinning the pages on every
+    // request; without them (RLIMIT_MEMLOCK) plain READ/WRITE still work
+    struct iovec iov[URING_SLOTS];
+    for (unsigned i = 0; i < URING_SLOTS; i++) {
+        iov[i].iov_base = ctx->buffers + i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    ctx->fixed = syscall(__NR_io_uring_register, ctx->ring.fd, IORING_REGISTER_BUFFERS,
+                         iov, URING_SLOTS) == 0;
+    return ctx;
+}
+
+enum copy_result copy_uring(int source_fd, int dest_fd, const struct stat* source_stat) {
+    off_t size = source_stat->st_size;
+    if (size == 0)
+        return COPY_DONE;
+
+    struct uring_context* ctx = get_context();
+    if (ctx == NULL)
+        return COPY_UNSUPPORTED;
+    struct uring* ring = &ctx->ring;
+    int fixed = ctx->fixed;
+
+    struct slot slots[URING_SLOTS];
+    for (unsigned i = 0; i < URING_SLOTS; i++) {
+        slots[i].state = SLOT_IDLE;
+        slots[i].buffer = ctx->buffers + i * URING_BUFFER_SIZE;
+    }
+
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+
+    // The source is not expected to change while it is being moved: reads
+    // are issued up to the size it had when the move started
+    off_t next_offset = 0;
+    unsigned in_flight = 0;
+    for (unsigned i = 0; i < URING_SLOTS && next_offset < size; i++) {
+        size_t len = size - next_offset < URING_BUFFER_SIZE ? (size_t)(size - next_offset) : URING_BUFFER_SIZE;
+        queue_read(ring, source_fd, slots, i, next_offset, len, fixed);
+        next_offset += len;
+        in_flight++;
+    }
+
+    enum copy_result result = COPY_DONE;
+    off_t copied = 0;
+    int error = 0;
+
+    while (in_flight > 0) {
+        if (uring_submit_and_wait(ring) == -1) {
+            // Only fails for bad arguments or when the kernel cannot
+            // allocate requests; before the first completion it is safe
+            // to redo the whole copy with the read/write loop
+            error = errno;
+            result = copied == 0 ? COPY_UNSUPPORTED : COPY_WRITE_ERROR;
+            // Requests may still be in flight: give up on io_uring for this
+            // thread and leave the ring and buffers to the kernel
+            ctx->failed = 1;
+            break;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned index = cqe->user_data;
+            struct slot* slot = &slots[index];
+            int res = cqe->res;
+
+            if (res == -EINTR || res == -EAGAIN)
+                res = 0; // resubmitted below as if nothing was transferred
+            else if (res == 0 && slot->state == SLOT_WRITING)
+                res = -EIO;
+            if (res < 0 && result == COPY_DONE) {
+                // Let the other requests drain before reporting the error
+                error = -res;
+                if (copied == 0 && slot->state == SLOT_READING && (error == EINVAL || error == EOPNOTSUPP))
+                    result = COPY_UNSUPPORTED;
+                else
+                    result = slot->state == SLOT_READING ? COPY_READ_ERROR : COPY_WRITE_ERROR;
+            }
+
+            if (result != COPY_DONE) {
+                slot->state = SLOT_IDLE;
+                in_flight--;
+                continue;
+            }
+
+            slot->done += res;
+            if (slot->state == SLOT_READING && cqe->res == 0) {
+                // Unexpected end of file: the source shrank under us
+                if (slot->offset + (off_t)slot->done < size)
+                    size = slot->offset + slot->done;
+                slot->len = slot->done;
+            }
+
+            if (slot->done < slot->len) {
+                // Short transfer: ask for the rest
+                uring_queue(ring, slot->state == SLOT_READING ?
+                                   (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ) :
+                                   (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE),
+                            slot->state == SLOT_READING ? source_fd : dest_fd, slot, index, fixed);
+            } else if (slot->state == SLOT_READING && slot->len > 0) {
+                slot->state = SLOT_WRITING;
+                slot->done = 0;
+                uring_queue(ring, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, dest_fd, slot,
+                            index, fixed);
+            } else {
+                copied += slot->len;
+                progress_add(slot->len);
+                if (next_offset < size) {
+                    size_t len = size - next_offset < URING_BUFFER_SIZE ?
+                                 (size_t)(size - next_offset) : URING_BUFFER_SIZE;
+                    queue_read(ring, source_fd, slots, index, next_offset, len, fixed);
+                    next_offset += len;
+                } else {
+                    slot->state = SLOT_IDLE;
+                    in_flight--;
+                }
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // The file offsets were never advanced; leave the destination where a
+    // sequential copy would have left it
+    if (result == COPY_DONE && lseek(dest_fd, size, SEEK_SET) == -1) {
+        error = errno;
+        result = COPY_WRITE_ERROR;
+    }
+
+    errno = error;
+    return result;
+}
@@ -0,0 +1,102 @@
+#!/bin/bash
+# Check that a maze read from stdin is perfect: every room reachable from
+# every other by exactly one path.
+#
+# Usage: ./maze_p3 [options] seed chars size | ./check_maze.sh
+#
+# Text and binary ("MAZE" header) output are both accepted; binary is
+# decoded to the text layout first. The check fails on a malformed grid,
+# an open outer wall, a passage that closes a cycle, or a count of
+# passages other than rooms - 1 (which, without cycles, means the rooms
+# are not all connected), with the reason on stderr. Prints
+# "perfect WIDTHxHEIGHT" on success.
+
+set -e
+set -o pipefail
+
+tmp=$(mktemp)
+trap 'rm -f "$tmp"' EXIT
+cat > "$tmp"
+
+# Binary: 16-byte header, then (width + 3) / 4 bytes per row with two bits
+# per room, east wall in the low bit and south wall in the high bit
+decode() {
+    od -An -v -tu1 "$tmp" | awk '
+    { for (i = 1; i <= NF; i++) b[n++] = $i }
+    END {
+        w = 0; h = 0
+        for (i = 3; i >= 0; i--) w = w * 256 + b[4 + i]
+        for (i = 7; i >= 0; i--) h = h * 256 + b[8 + i]
+        stride = int((w + 3) / 4)
+        line = ""
+        for (x = 0; x < 2 * w + 1; x++) line = line "#"
+        print line
+        for (y = 0; y < h; y++) {
+            rooms = "#"; souths = "#"
+            for (x = 0; x < w; x++) {
+                v = int(b[16 + y * stride + int(x / 4)] / 2 ^ (2 * (x % 4))) % 4
+                rooms = rooms "." (v % 2 ? "#" : ".")
+                souths = souths (v >= 2 ? "#" : ".") "#"
+            }
+            print rooms
+            print souths
+        }
+    }'
+}
+
+if [ "$(head -c 4 "$tmp")" = "MAZE" ]; then
+    decode > "$tmp.text"
+    mv "$tmp.text" "$tmp"
+fi
+
+awk '
+function find(x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]]
+        x = parent[x]
+    }
+    return x
+}
+function join(a, b,    ra, rb) {
+    ra = find(a); rb = find(b)
+    if (ra == rb) {
+        printf "passage from room %d,%d closes a cycle\n", a % w, int(a / w) > "/dev/stderr"
+        bad = 1
+        exit 1
+    }
+    parent[ra] = rb
+    edges++
+}
+function fail(msg) {
+    print msg > "/dev/stderr"
+    bad = 1
+    exit 1
+}
+{ grid[NR - 1] = $0 }
+END {
+    if (bad) exit 1
+    if (NR < 3 || NR % 2 == 0) fail("bad line count " NR)
+    cols = length(grid[0])
+    if (cols < 3 || cols % 2 == 0) fail("bad line length " cols)
+    wall = substr(grid[0], 1, 1)
+    w = (cols - 1) / 2; h = (NR - 1) / 2
+    for (r = 0; r < NR; r++) {
+        if (length(grid[r]) != cols) fail("line " r + 1 " is " length(grid[r]) " long, not " cols)
+        if (substr(grid[r], 1, 1) != wall || substr(grid[r], cols, 1) != wall) fail("open outer wall on line " r + 1)
+    }
+    for (c = 1; c <= cols; c++) {
+        if (substr(grid[0], c, 1) != wall || substr(grid[NR - 1], c, 1) != wall) fail("open outer wall in column " c)
+    }
+    for (i = 0; i < w * h; i++) parent[i] = i
+    for (y = 0; y < h; y++) {
+        rooms = grid[2 * y + 1]; souths = grid[2 * y + 2]
+        for (x = 0; x < w; x++) {
+            if (substr(rooms, 2 * x + 2, 1) == wall) fail("room " x "," y " is a wall")
+            if (x + 1 < w && substr(rooms, 2 * x + 3, 1) != wall) join(y * w + x, y * w + x + 1)
+            if (y + 1 < h && substr(souths, 2 * x + 2, 1) != wall) join(y * w + x, (y + 1) * w + x)
+            if (x + 1 < w && y + 1 < h && substr(souths, 2 * x + 3, 1) != wall) fail("open corner below room " x "," y)
+        }
+    }
+    if (edges != w * h - 1) fail(edges + 0 " passages for " w * h " rooms: not connected")
+    printf "perfect %dx%d\n", w, h
+}' "$tmp"
@@ -1,184 +1,1024 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
+static double seconds_since(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Time spent in each phase of a run, reported with -T
+enum {
+    PHASE_WALLS,
+    PHASE_SHUFFLE,
+    PHASE_UNION,
+    PHASE_TILES,
+    PHASE_STITCH,
+    PHASE_ROWS,
+    PHASE_SOLVE,
+    PHASE_OUTPUT,
+    PHASES
+};
+
+static const char* const phase_names[PHASES] = {
+    "walls", "shuffle", "union-find", "tiles", "stitch", "eller rows", "solve", "output",
+};
+
+static double phase_seconds[PHASES];
+static struct timespec phase_start;
+
+static void phase_begin(void) {
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+static void phase_end(int phase) {
+    phase_seconds[phase] += seconds_since(&phase_start);
+}
+
+// One line on stderr with the phases that ran, their total and the peak
+// resident set size, which covers every allocation the run made
+static void report_phases(int width, uint64_t height) {
+    double total = 0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    
+    fprintf(stderr, "maze %dx%llu:", width, (unsigned long long)height);
+    for (int i = 0; i < PHASES; i++) {
+        if (phase_seconds[i] == 0) continue;
+        fprintf(stderr, " %s %.3f s,", phase_names[i], phase_seconds[i]);
+        total += phase_seconds[i];
+    }
+    fprintf(stderr, " total %.3f s, peak RSS %.1f MB\n", total, usage.ru_maxrss / 1024.0);
+}
+
+// Each room's parent and set size sit side by side, so a step of find
+// touches one cache line. Room indices are 32-bit, which caps a maze at
+// 2^32 - 1 rooms and keeps the array at 8 bytes per room.
 typedef struct {
-    int x, y;
-    int room1_x, room1_y;
-    int room2_x, room2_y;
-} Wall;
+    uint32_t parent;
+    uint32_t size;
+} SetNode;
 
 typedef struct {
-    int* parent;
-    int* rank;
+    SetNode* nodes;
 } DisjointSet;
 
-DisjointSet* create_disjoint_set(int n) {
+DisjointSet* create_disjoint_set(uint64_t n) {
+    if (n > UINT32_MAX) return NULL;
+    
     DisjointSet* set = malloc(sizeof(DisjointSet));
-    set->parent = malloc(n * sizeof(int));
-    set->rank = malloc(n * sizeof(int));
+    if (set == NULL) return NULL;
+    set->nodes = malloc(n * sizeof(SetNode));
+    if (set->nodes == NULL) {
+        free(set);
+        return NULL;
+    }
     
-    for (int i = 0; i < n; i++) {
-        set->parent[i] = i;
-        set->rank[i] = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        set->nodes[i].parent = i;
+        set->nodes[i].size = 1;
     }
     
     return set;
 }
 
-int find_set(DisjointSet* set, int x) {
-    if (set->parent[x] != x) {
-        set->parent[x] = find_set(set, set->parent[x]);
+// Path halving: every other node on the way up is pointed at its
+// grandparent. Iterative, so deep trees cannot overflow the stack.
+uint32_t find_set(DisjointSet* set, uint32_t x) {
+    SetNode* nodes = set->nodes;
+    
+    while (nodes[x].parent != x) {
+        nodes[x].parent = nodes[nodes[x].parent].parent;
+        x = nodes[x].parent;
     }
-    return set->parent[x];
+    return x;
 }
 
-void union_sets(DisjointSet* set, int x, int y) {
-    int root_x = find_set(set, x);
-    int root_y = find_set(set, y);
+// Returns false if x and y were already in the same set
+bool union_sets(DisjointSet* set, uint32_t x, uint32_t y) {
+    uint32_t root_x = find_set(set, x);
+    uint32_t root_y = find_set(set, y);
     
-    if (root_x == root_y) return;
+    if (root_x == root_y) return false;
     
-    if (set->rank[root_x] < set->rank[root_y]) {
-        set->parent[root_x] = root_y;
-    } else {
-        set->parent[root_y] = root_x;
-        if (set->rank[root_x] == set->rank[root_y]) {
-            set->rank[root_x]++;
-        }
+    // The smaller tree goes under the larger one
+    if (set->nodes[root_x].size < set->nodes[root_y].size) {
+        uint32_t temp = root_x;
+        root_x = root_y;
+        root_y = temp;
     }
+    set->nodes[root_y].parent = root_x;
+    set->nodes[root_x].size += set->nodes[root_y].size;
+    return true;
 }
 
 void free_disjoint_set(DisjointSet* set) {
-    free(set->parent);
-    free(set->rank);
+    free(set->nodes);
     free(set);
 }
 
-int room_to_index(int x, int y, int width) {
-    return y * width + x;
+// The grid keeps two bits per room: whether its east and its south wall
+// are standing. The outer border and the wall corners are always solid, so
+// they are not stored. A 50000x50000 maze takes 625 MB this way.
+#define WALL_EAST 1
+#define WALL_SOUTH 2
+
+typedef struct {
+    int width, height;
+    uint8_t* cells;
+} Maze;
+
+// A wall is identified by the room west or north of it and its direction:
+// id = room * 2 + 0 for the east wall, room * 2 + 1 for the south wall
+typedef uint64_t WallId;
+
+uint64_t room_to_index(int x, int y, int width) {
+    return (uint64_t)y * width + x;
+}
+
+Maze* create_maze(int width, int height) {
+    Maze* maze = malloc(sizeof(Maze));
+    if (maze == NULL) return NULL;
+    
+    uint64_t rooms = (uint64_t)width * height;
+    maze->width = width;
+    maze->height = height;
+    // One spare byte, so cell_byte can read past the last room
+    maze->cells = malloc((rooms + 3) / 4 + 1);
+    if (maze->cells == NULL) {
+        free(maze);
+        return NULL;
+    }
+    
+    // All walls standing
+    memset(maze->cells, 0xFF, (rooms + 3) / 4 + 1);
+    return maze;
+}
+
+void free_maze(Maze* maze) {
+    free(maze->cells);
+    free(maze);
+}
+
+static inline int has_wall(const Maze* maze, uint64_t room, int wall) {
+    return (maze->cells[room >> 2] >> ((room & 3) * 2)) & wall;
+}
+
+// Walls of the four rooms starting at room, in the same layout as a byte
+// of cells; room does not have to be a multiple of 4
+static inline uint8_t cell_byte(const Maze* maze, uint64_t room) {
+    uint64_t i = room >> 2;
+    return (maze->cells[i] | maze->cells[i + 1] << 8) >> ((room & 3) * 2);
+}
+
+static inline void remove_wall(Maze* maze, uint64_t room, int wall) {
+    maze->cells[room >> 2] &= ~(wall << ((room & 3) * 2));
+}
+
+// For threads working on neighbouring tiles, whose rooms can share a byte
+static inline void remove_wall_shared(Maze* maze, uint64_t room, int wall) {
+    __atomic_fetch_and(&maze->cells[room >> 2], (uint8_t)~(wall << ((room & 3) * 2)), __ATOMIC_RELAXED);
+}
+
+// PCG32 (XSH-RR), the generator used in 10_LibTesting/tests.c, with a
+// selectable stream: generators seeded alike but on different streams
+// give independent sequences, which is what the tiles need
+typedef struct {
+    uint64_t state;
+    uint64_t inc;
+} Rng;
+
+static Rng rng;
+
+uint32_t rng_next(Rng* r) {
+    uint64_t p = r->state;
+    r->state = p * 0x5851f42d4c957f2d + r->inc;
+    uint32_t x = ((p >> 18) ^ p) >> 27;
+    uint32_t rot = p >> 59;
+    return (x >> rot) | (x << (-rot & 31u));
+}
+
+void rng_seed(Rng* r, uint64_t seed, uint64_t stream) {
+    r->state = 0;
+    r->inc = stream << 1 | 1;
+    rng_next(r);
+    r->state += seed;
+    rng_next(r);
+}
+
+// Uniform in [0, range) without division in the common case (Lemire's
+// multiply-and-reject). The rejection keeps it unbiased, unlike
+// rand() % range.
+uint32_t rng_bounded(Rng* r, uint32_t range) {
+    uint64_t m = (uint64_t)rng_next(r) * range;
+    if ((uint32_t)m < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t)m < threshold) {
+            m = (uint64_t)rng_next(r) * range;
+        }
+    }
+    return m >> 32;
+}
+
+// The same for ranges past 2^32, on 64-bit draws
+uint64_t rng_bounded64(Rng* r, uint64_t range) {
+    // Two statements: the operands of | may be evaluated in either order
+    uint64_t hi = rng_next(r);
+    uint64_t lo = rng_next(r);
+    uint64_t x = hi << 32 | lo;
+    unsigned __int128 m = (unsigned __int128)x * range;
+    if ((uint64_t)m < range) {
+        uint64_t threshold = -range % range;
+        while ((uint64_t)m < threshold) {
+            hi = rng_next(r);
+            lo = rng_next(r);
+            x = hi << 32 | lo;
+            m = (unsigned __int128)x * range;
+        }
+    }
+    return m >> 64;
 }
 
-void shuffle_walls(Wall* walls, int count) {
-    for (int i = count - 1; i > 0; i--) {
-        int j = rand() % (i + 1);
-        Wall temp = walls[i];
+// Fisher-Yates with the generator passed in, so threads shuffle independently
+void shuffle_walls(WallId* walls, uint64_t count, Rng* r) {
+    if (count < 2) return;
+    
+    for (uint64_t i = count - 1; i > 0; i--) {
+        uint64_t j = i < UINT32_MAX ? rng_bounded(r, i + 1) : rng_bounded64(r, i + 1);
+        WallId temp = walls[i];
         walls[i] = walls[j];
         walls[j] = temp;
     }
 }
 
-void init_maze(char** maze, int maze_size) {
-    int actual_size = maze_size * 2 + 1;
+uint64_t count_walls(int width, int height) {
+    return (uint64_t)width * (height - 1) + (uint64_t)(width - 1) * height;
+}
+
+WallId* generate_walls(int width, int height, uint64_t* wall_count) {
+    *wall_count = count_walls(width, height);
+    WallId* walls = malloc(*wall_count * sizeof(WallId));
+    if (walls == NULL && *wall_count > 0) return NULL;
+    uint64_t wall_idx = 0;
+    
+    for (int y = 0; y < height - 1; y++) {
+        for (int x = 0; x < width; x++) {
+            walls[wall_idx++] = room_to_index(x, y, width) * 2 + 1;
+        }
+    }
     
-    for (int i = 0; i < actual_size; i++) {
-        for (int j = 0; j < actual_size; j++) {
-            maze[i][j] = '#';
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width - 1; x++) {
+            walls[wall_idx++] = room_to_index(x, y, width) * 2;
         }
     }
     
-    for (int i = 0; i < maze_size; i++) {
-        for (int j = 0; j < maze_size; j++) {
-            maze[i * 2 + 1][j * 2 + 1] = '.';
+    return walls;
+}
+
+// Kruskal's step: remove each wall that joins two sets, in order, until
+// needed walls are gone. Returns how many were removed.
+uint64_t join_walls(Maze* maze, DisjointSet* set, const WallId* walls, uint64_t count,
+                    uint64_t needed, bool shared) {
+    int width = maze->width;
+    uint64_t walls_removed = 0;
+    
+    for (uint64_t i = 0; i < count && walls_removed < needed; i++) {
+        uint32_t room1_idx = walls[i] >> 1;
+        int wall = walls[i] & 1 ? WALL_SOUTH : WALL_EAST;
+        uint32_t room2_idx = wall == WALL_SOUTH ? room1_idx + width : room1_idx + 1;
+        
+        if (union_sets(set, room1_idx, room2_idx)) {
+            if (shared) {
+                remove_wall_shared(maze, room1_idx, wall);
+            } else {
+                remove_wall(maze, room1_idx, wall);
+            }
+            walls_removed++;
         }
     }
+    return walls_removed;
 }
 
-int count_walls(int maze_size) {
-    return 2 * maze_size * (maze_size - 1);
+int generate_maze(Maze* maze) {
+    int width = maze->width;
+    uint64_t wall_count;
+    phase_begin();
+    WallId* walls = generate_walls(width, maze->height, &wall_count);
+    if (walls == NULL && wall_count > 0) return -1;
+    phase_end(PHASE_WALLS);
+    
+    phase_begin();
+    shuffle_walls(walls, wall_count, &rng);
+    phase_end(PHASE_SHUFFLE);
+    
+    phase_begin();
+    DisjointSet* set = create_disjoint_set((uint64_t)width * maze->height);
+    if (set == NULL) {
+        free(walls);
+        return -1;
+    }
+    
+    join_walls(maze, set, walls, wall_count, (uint64_t)width * maze->height - 1, false);
+    
+    free_disjoint_set(set);
+    phase_end(PHASE_UNION);
+    free(walls);
+    return 0;
 }
 
-Wall* generate_walls(int maze_size, int* wall_count) {
-    *wall_count = count_walls(maze_size);
-    Wall* walls = malloc(*wall_count * sizeof(Wall));
-    int wall_idx = 0;
+// Tiled generation: the maze is cut into TILE_SIZE x TILE_SIZE tiles that
+// threads turn into independent mazes, each with its own PCG stream.
+// Tiles have disjoint rooms, so they share the union-find without locks.
+// A final Kruskal pass over the walls between tiles joins them into one
+// perfect maze. The walls on tile borders are fewer than 2 / TILE_SIZE of
+// all walls, so the serial part stays small.
+#define TILE_SIZE 512
+
+typedef struct {
+    Maze* maze;
+    DisjointSet* set;
+    int tiles_x, tiles_y;
+    int next_tile;        // next tile to generate, taken atomically
+    Rng base;             // seeds every tile, which picks its own stream
+    bool failed;
+} TileJob;
+
+static void generate_tile(TileJob* job, int tile, WallId* walls) {
+    int width = job->maze->width;
+    int x0 = tile % job->tiles_x * TILE_SIZE;
+    int y0 = tile / job->tiles_x * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE < width ? x0 + TILE_SIZE : width;
+    int y1 = y0 + TILE_SIZE < job->maze->height ? y0 + TILE_SIZE : job->maze->height;
+    uint64_t count = 0;
     
-    for (int y = 0; y < maze_size - 1; y++) {
-        for (int x = 0; x < maze_size; x++) {
-            walls[wall_idx].x = x * 2 + 1;
-            walls[wall_idx].y = y * 2 + 2;
-            walls[wall_idx].room1_x = x;
-            walls[wall_idx].room1_y = y;
-            walls[wall_idx].room2_x = x;
-            walls[wall_idx].room2_y = y + 1;
-            wall_idx++;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            uint64_t room = room_to_index(x, y, width);
+            if (x + 1 < x1) walls[count++] = room * 2;
+            if (y + 1 < y1) walls[count++] = room * 2 + 1;
         }
     }
     
-    for (int y = 0; y < maze_size; y++) {
-        for (int x = 0; x < maze_size - 1; x++) {
-            walls[wall_idx].x = x * 2 + 2;
-            walls[wall_idx].y = y * 2 + 1;
-            walls[wall_idx].room1_x = x;
-            walls[wall_idx].room1_y = y;
-            walls[wall_idx].room2_x = x + 1;
-            walls[wall_idx].room2_y = y;
-            wall_idx++;
+    // Distinct streams for distinct tiles, the same ones for every run
+    // with the same seed whatever the number of threads
+    Rng r;
+    rng_seed(&r, job->base.state, tile + 1);
+    shuffle_walls(walls, count, &r);
+    join_walls(job->maze, job->set, walls, count, (uint64_t)(x1 - x0) * (y1 - y0) - 1, true);
+}
+
+static void* tile_worker(void* arg) {
+    TileJob* job = arg;
+    int tiles = job->tiles_x * job->tiles_y;
+    WallId* walls = malloc(2 * TILE_SIZE * TILE_SIZE * sizeof(WallId));
+    if (walls == NULL) {
+        __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    
+    int tile;
+    while ((tile = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED)) < tiles) {
+        generate_tile(job, tile, walls);
+    }
+    free(walls);
+    return NULL;
+}
+
+int generate_maze_tiled(Maze* maze, int threads) {
+    int width = maze->width;
+    int height = maze->height;
+    phase_begin();
+    TileJob job = {
+        .maze = maze,
+        .tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE,
+        .tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE,
+        .base = rng,
+    };
+    job.set = create_disjoint_set((uint64_t)width * height);
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    if (job.set == NULL || ids == NULL) {
+        if (job.set != NULL) free_disjoint_set(job.set);
+        free(ids);
+        return -1;
+    }
+    
+    int started = 0;
+    while (started < threads && pthread_create(&ids[started], NULL, tile_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        tile_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+    phase_end(PHASE_TILES);
+    
+    phase_begin();
+    // Walls on the east and south borders of the tiles, except the outer ones
+    uint64_t count = (uint64_t)(job.tiles_x - 1) * height + (uint64_t)(job.tiles_y - 1) * width;
+    WallId* walls = malloc(count * sizeof(WallId));
+    if (job.failed || (walls == NULL && count > 0)) {
+        free_disjoint_set(job.set);
+        free(walls);
+        return -1;
+    }
+    
+    uint64_t wall_idx = 0;
+    for (int x = TILE_SIZE - 1; x < width - 1; x += TILE_SIZE) {
+        for (int y = 0; y < height; y++) {
+            walls[wall_idx++] = room_to_index(x, y, width) * 2;
+        }
+    }
+    for (int y = TILE_SIZE - 1; y < height - 1; y += TILE_SIZE) {
+        for (int x = 0; x < width; x++) {
+            walls[wall_idx++] = room_to_index(x, y, width) * 2 + 1;
         }
     }
     
-    return walls;
+    rng_next(&rng); // the tiles used the current state
+    shuffle_walls(walls, count, &rng);
+    join_walls(maze, job.set, walls, count, (uint64_t)job.tiles_x * job.tiles_y - 1, false);
+    
+    free_disjoint_set(job.set);
+    free(walls);
+    phase_end(PHASE_STITCH);
+    return 0;
+}
+
+// Rows are rendered into one buffer that is written with large fwrite
+// calls. Text output turns each cell byte (four rooms) into eight
+// characters per line through lookup tables.
+//
+// The binary format is "MAZE", the width as a 32-bit and the height as a
+// 64-bit little-endian number, then one row after the other in
+// (width + 3) / 4 bytes: room x of a row is in bits 2 * (x % 4) (east
+// wall) and 2 * (x % 4) + 1 (south wall) of byte x / 4.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE* file;
+    bool binary;
+    int width;
+    char wall;
+    char* buf;
+    size_t size, used;
+    char rooms[256][8];   // rooms and east walls
+    char souths[256][8];  // south walls and corners
+    const uint64_t* path; // rooms to mark with path_mark in text output, or NULL
+    char path_mark;
+} Output;
+
+static inline bool test_bit(const uint64_t* bits, uint64_t i) {
+    return bits[i >> 6] >> (i & 63) & 1;
+}
+
+static inline void set_bit(uint64_t* bits, uint64_t i) {
+    bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static size_t row_bytes(const Output* out) {
+    return out->binary ? ((size_t)out->width + 3) / 4 : 2 * (2 * (size_t)out->width + 2);
+}
+
+Output* open_output(FILE* file, int width, bool binary, char wall, char passage) {
+    Output* out = malloc(sizeof(Output));
+    if (out == NULL) return NULL;
+    
+    out->file = file;
+    out->binary = binary;
+    out->width = width;
+    out->wall = wall;
+    out->used = 0;
+    out->path = NULL;
+    out->size = row_bytes(out) > OUTPUT_BUFFER_SIZE ? row_bytes(out) : OUTPUT_BUFFER_SIZE;
+    out->buf = malloc(out->size);
+    if (out->buf == NULL) {
+        free(out);
+        return NULL;
+    }
+    
+    for (int b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            out->rooms[b][2 * k] = passage;
+            out->rooms[b][2 * k + 1] = b >> (2 * k) & WALL_EAST ? wall : passage;
+            out->souths[b][2 * k] = b >> (2 * k) & WALL_SOUTH ? wall : passage;
+            out->souths[b][2 * k + 1] = wall;
+        }
+    }
+    return out;
+}
+
+static void flush_output(Output* out) {
+    if (out->used > 0) {
+        fwrite(out->buf, 1, out->used, out->file);
+        out->used = 0;
+    }
 }
 
-void generate_maze(char** maze, int maze_size) {
-    int wall_count;
-    Wall* walls = generate_walls(maze_size, &wall_count);
+// Reserve len bytes in the buffer; len is at most out->size
+static char* output_space(Output* out, size_t len) {
+    if (out->used + len > out->size) {
+        flush_output(out);
+    }
+    char* p = out->buf + out->used;
+    out->used += len;
+    return p;
+}
+
+// Top border for text, header for binary
+void output_header(Output* out, uint64_t height) {
+    if (out->binary) {
+        unsigned char* p = (unsigned char*)output_space(out, 16);
+        memcpy(p, "MAZE", 4);
+        for (int i = 0; i < 4; i++) {
+            p[4 + i] = (uint32_t)out->width >> (8 * i);
+        }
+        for (int i = 0; i < 8; i++) {
+            p[8 + i] = height >> (8 * i);
+        }
+        return;
+    }
     
-    shuffle_walls(walls, wall_count);
+    size_t len = 2 * (size_t)out->width + 2;
+    char* p = output_space(out, len);
+    memset(p, out->wall, len - 1);
+    p[len - 1] = '\n';
+}
+
+// Row y of the maze: for text, the rooms with their east walls, then the
+// south walls with the corners between them
+void output_row(Output* out, const Maze* maze, int y) {
+    int width = maze->width;
+    uint64_t row = room_to_index(0, y, width);
+    char* p = output_space(out, row_bytes(out));
+    int x;
+    
+    if (out->binary) {
+        for (x = 0; x < width; x += 4) {
+            *p++ = cell_byte(maze, row + x);
+        }
+        // Clear the bits past the end of the row
+        if (width % 4 != 0) {
+            p[-1] &= (1 << (width % 4 * 2)) - 1;
+        }
+        return;
+    }
     
-    DisjointSet* set = create_disjoint_set(maze_size * maze_size);
+    char* rooms = p;
+    char* souths = p + 2 * width + 2;
+    *rooms++ = out->wall;
+    *souths++ = out->wall;
+    for (x = 0; x + 4 <= width; x += 4) {
+        uint8_t b = cell_byte(maze, row + x);
+        memcpy(rooms, out->rooms[b], 8);
+        memcpy(souths, out->souths[b], 8);
+        rooms += 8;
+        souths += 8;
+    }
+    if (x < width) {
+        uint8_t b = cell_byte(maze, row + x);
+        memcpy(rooms, out->rooms[b], (width - x) * 2);
+        memcpy(souths, out->souths[b], (width - x) * 2);
+        rooms += (width - x) * 2;
+        souths += (width - x) * 2;
+    }
+    *rooms = '\n';
+    *souths = '\n';
     
-    int min_walls_to_remove = maze_size * maze_size - 1;
+    // The maze is a tree, so two neighbouring rooms on the path with no
+    // wall between them are consecutive on it
+    if (out->path != NULL) {
+        rooms = p + 1;
+        souths = p + 2 * width + 3;
+        for (x = 0; x < width; x++) {
+            uint64_t room = row + x;
+            if (!test_bit(out->path, room)) continue;
+            rooms[2 * x] = out->path_mark;
+            if (!has_wall(maze, room, WALL_EAST) && test_bit(out->path, room + 1)) {
+                rooms[2 * x + 1] = out->path_mark;
+            }
+            if (!has_wall(maze, room, WALL_SOUTH) && test_bit(out->path, room + width)) {
+                souths[2 * x] = out->path_mark;
+            }
+        }
+    }
+}
+
+// Returns -1 if anything could not be written
+int close_output(Output* out) {
+    flush_output(out);
+    int failed = fflush(out->file) != 0 || ferror(out->file);
+    free(out->buf);
+    free(out);
+    return failed ? -1 : 0;
+}
+
+void print_maze(const Maze* maze, Output* out) {
+    output_header(out, maze->height);
+    for (int y = 0; y < maze->height; y++) {
+        output_row(out, maze, y);
+    }
+}
+
+#define NO_ROOM UINT32_MAX
+
+// Root of column x's set in the current row, halving the path on the way
+static uint32_t row_find(uint32_t* parent, uint32_t x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+// Eller's algorithm: the maze is generated and printed one row at a time.
+// Only the sets of the current row are kept, so memory grows with the
+// width and the height is unbounded. Each row:
+//   1. neighbours in different sets are joined at random (all of them on
+//      the last row, which makes the maze connected);
+//   2. every set opens at least one south wall, chosen at random;
+//   3. rooms below an opening stay in their set, the others start new ones.
+int generate_eller(int width, uint64_t height, Output* out) {
+    Maze* row = create_maze(width, 1);
+    uint32_t* parent = malloc(width * sizeof(uint32_t));
+    uint32_t* down = malloc(width * sizeof(uint32_t)); // per set: a room opening south
+    if (row == NULL || parent == NULL || down == NULL) {
+        if (row != NULL) free_maze(row);
+        free(parent);
+        free(down);
+        return -1;
+    }
     
-    int max_walls_to_keep = wall_count - min_walls_to_remove;
-    int min_walls_to_keep = max_walls_to_keep * 0.15;
-    int walls_removed = 0;
+    for (int x = 0; x < width; x++) {
+        parent[x] = x;
+    }
     
-    for (int i = 0; i < wall_count && walls_removed < min_walls_to_remove; i++) {
-        int room1_idx = room_to_index(walls[i].room1_x, walls[i].room1_y, maze_size);
-        int room2_idx = room_to_index(walls[i].room2_x, walls[i].room2_y, maze_size);
+    phase_begin();
+    output_header(out, height);
+    for (uint64_t y = 0; y < height; y++) {
+        bool last_row = y == height - 1;
+        memset(row->cells, 0xFF, ((uint64_t)width + 3) / 4);
         
-        if (find_set(set, room1_idx) != find_set(set, room2_idx)) {
-            maze[walls[i].y][walls[i].x] = '.';
-            
-            union_sets(set, room1_idx, room2_idx);
-            walls_removed++;
+        for (int x = 0; x < width - 1; x++) {
+            uint32_t left = row_find(parent, x);
+            uint32_t right = row_find(parent, x + 1);
+            if (left != right && (last_row || rng_next(&rng) >> 31)) {
+                remove_wall(row, x, WALL_EAST);
+                parent[right] = left;
+            }
+        }
+        
+        if (!last_row) {
+            // Flatten, so parent[x] is the set of x from here on
+            for (int x = 0; x < width; x++) {
+                parent[x] = row_find(parent, x);
+                down[parent[x]] = NO_ROOM;
+            }
+            for (int x = 0; x < width; x++) {
+                if (rng_next(&rng) >> 31) {
+                    remove_wall(row, x, WALL_SOUTH);
+                    down[parent[x]] = x;
+                }
+            }
+            // A set with no opening gets one at its rightmost room
+            for (int x = width - 1; x >= 0; x--) {
+                if (down[parent[x]] == NO_ROOM) {
+                    remove_wall(row, x, WALL_SOUTH);
+                    down[parent[x]] = x;
+                }
+            }
+            // Rooms below an opening join under it; parent[x] is read
+            // before it is overwritten, and down[] maps to rooms that
+            // become their own parents
+            for (int x = 0; x < width; x++) {
+                parent[x] = has_wall(row, x, WALL_SOUTH) ? (uint32_t)x : down[parent[x]];
+            }
         }
+        
+        output_row(out, row, 0);
     }
+    phase_end(PHASE_ROWS);
     
-    free_disjoint_set(set);
-    free(walls);
+    free_maze(row);
+    free(parent);
+    free(down);
+    return 0;
+}
+
+// Shortest path search between two rooms. State is kept in flat arrays
+// indexed by room: the room each one was reached from and, for A*, its
+// distance from the start, plus a bitset of the rooms already reached.
+typedef struct {
+    uint64_t* path;       // bitset of the rooms on the path
+    uint64_t length;      // rooms on the path, both ends included
+    uint64_t expanded;    // rooms taken off the queue or heap
+} Solution;
+
+// Open neighbours of room. East and south walls on the border are always
+// standing, and the east wall of the room before a row's first one too,
+// so only the north side needs a bounds check.
+static int open_neighbours(const Maze* maze, uint32_t room, uint32_t* next) {
+    int width = maze->width;
+    int n = 0;
+    
+    if (!has_wall(maze, room, WALL_EAST)) next[n++] = room + 1;
+    if (!has_wall(maze, room, WALL_SOUTH)) next[n++] = room + width;
+    if (room > 0 && !has_wall(maze, room - 1, WALL_EAST)) next[n++] = room - 1;
+    if (room >= (uint32_t)width && !has_wall(maze, room - width, WALL_SOUTH)) next[n++] = room - width;
+    return n;
+}
+
+static uint64_t solve_bfs(const Maze* maze, uint32_t start, uint32_t goal, uint32_t* from, uint64_t* reached,
+                          uint32_t* queue) {
+    uint64_t head = 0, tail = 0;
+    
+    queue[tail++] = start;
+    set_bit(reached, start);
+    while (head < tail) {
+        uint32_t room = queue[head++];
+        if (room == goal) break;
+        
+        uint32_t next[4];
+        int n = open_neighbours(maze, room, next);
+        for (int i = 0; i < n; i++) {
+            if (test_bit(reached, next[i])) continue;
+            set_bit(reached, next[i]);
+            from[next[i]] = room;
+            queue[tail++] = next[i];
+        }
+    }
+    return head;
+}
+
+// Binary min-heap of (estimate << 32 | room)
+typedef struct {
+    uint64_t* items;
+    uint64_t count, capacity;
+} Heap;
+
+static int heap_push(Heap* heap, uint64_t item) {
+    if (heap->count == heap->capacity) {
+        uint64_t capacity = heap->capacity ? heap->capacity * 2 : 1024;
+        uint64_t* grown = realloc(heap->items, capacity * sizeof(uint64_t));
+        if (grown == NULL) return -1;
+        heap->items = grown;
+        heap->capacity = capacity;
+    }
+    
+    uint64_t i = heap->count++;
+    while (i > 0 && heap->items[(i - 1) / 2] > item) {
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i] = item;
+    return 0;
 }
 
-void print_maze(char** maze, int actual_size) {
-    for (int i = 0; i < actual_size; i++) {
-        for (int j = 0; j < actual_size; j++) {
-            printf("%c", maze[i][j]);
+static uint64_t heap_pop(Heap* heap) {
+    uint64_t top = heap->items[0];
+    uint64_t last = heap->items[--heap->count];
+    uint64_t i = 0;
+    
+    for (;;) {
+        uint64_t child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && heap->items[child + 1] < heap->items[child]) child++;
+        if (heap->items[child] >= last) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->count > 0) heap->items[i] = last;
+    return top;
+}
+
+// A* with the Manhattan distance, which never overestimates on a grid.
+// A room is expanded when it leaves the heap; reached marks those done.
+static int64_t solve_astar(const Maze* maze, uint32_t start, uint32_t goal, uint32_t* from, uint64_t* reached,
+                           uint32_t* dist) {
+    int width = maze->width;
+    int goal_x = goal % width, goal_y = goal / width;
+    Heap heap = {0};
+    uint64_t expanded = 0;
+    
+    dist[start] = 0;
+    if (heap_push(&heap, start) != 0) return -1;
+    while (heap.count > 0) {
+        uint32_t room = (uint32_t)heap_pop(&heap);
+        if (test_bit(reached, room)) continue;
+        set_bit(reached, room);
+        expanded++;
+        if (room == goal) break;
+        
+        uint32_t next[4];
+        int n = open_neighbours(maze, room, next);
+        for (int i = 0; i < n; i++) {
+            if (test_bit(reached, next[i])) continue;
+            int x = next[i] % width, y = next[i] / width;
+            uint64_t estimate = (uint64_t)dist[room] + 1 + abs(x - goal_x) + abs(y - goal_y);
+            dist[next[i]] = dist[room] + 1;
+            from[next[i]] = room;
+            if (heap_push(&heap, estimate << 32 | next[i]) != 0) {
+                free(heap.items);
+                return -1;
+            }
         }
-        printf("\n");
     }
+    free(heap.items);
+    return expanded;
+}
+
+int solve_maze(const Maze* maze, bool astar, uint32_t start, uint32_t goal, Solution* solution) {
+    uint64_t rooms = (uint64_t)maze->width * maze->height;
+    uint64_t words = (rooms + 63) / 64;
+    uint32_t* from = malloc(rooms * sizeof(uint32_t));
+    uint32_t* scratch = malloc(rooms * sizeof(uint32_t)); // BFS queue or A* distances
+    uint64_t* reached = calloc(words, sizeof(uint64_t));
+    if (from == NULL || scratch == NULL || reached == NULL) {
+        free(from);
+        free(scratch);
+        free(reached);
+        return -1;
+    }
+    
+    int64_t expanded = astar ? solve_astar(maze, start, goal, from, reached, scratch)
+                             : (int64_t)solve_bfs(maze, start, goal, from, reached, scratch);
+    free(scratch);
+    if (expanded < 0) {
+        free(from);
+        free(reached);
+        return -1;
+    }
+    
+    // Every room is reachable in a perfect maze; the bitset now holds the path
+    memset(reached, 0, words * sizeof(uint64_t));
+    solution->length = 1;
+    for (uint32_t room = goal; room != start; room = from[room]) {
+        set_bit(reached, room);
+        solution->length++;
+    }
+    set_bit(reached, start);
+    free(from);
+    
+    solution->path = reached;
+    solution->expanded = expanded;
+    return 0;
 }
 
-int main() {
-    srand(time(NULL));
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-b] [-e] [-r rows] [-t threads] [-s bfs|astar] [-c x1,y1,x2,y2] [-T]\n", prog);
+    fprintf(stderr, "  -b       write the packed binary format instead of text\n");
+    fprintf(stderr, "  -e       generate row by row with Eller's algorithm, in memory\n"
+                    "           proportional to the width; any number of rows\n");
+    fprintf(stderr, "  -r rows  number of rows (default: as many as columns)\n");
+    fprintf(stderr, "  -s algo  find the shortest path with bfs or astar, mark it in the\n"
+                    "           text output and report the search on stderr\n");
+    fprintf(stderr, "  -c x1,y1,x2,y2  rooms to connect (default: opposite corners)\n");
+    fprintf(stderr, "  -T       report the time of each phase and the peak memory on stderr\n");
+    fprintf(stderr, "  -t n     generate %dx%d tiles on n threads and join them\n", TILE_SIZE, TILE_SIZE);
+}
+
+int main(int argc, char** argv) {
+    bool binary = false;
+    bool eller = false;
+    bool report = false;
+    uint64_t rows = 0;
+    int threads = 0;
+    const char* solver = NULL;
+    long ends[4] = {0, 0, -1, -1}; // -1: the last column or row
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "bc:er:s:t:T")) != -1) {
+        switch (opt) {
+        case 'b':
+            binary = true;
+            break;
+        case 'c':
+            if (sscanf(optarg, "%ld,%ld,%ld,%ld", &ends[0], &ends[1], &ends[2], &ends[3]) != 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'e':
+            eller = true;
+            break;
+        case 'r':
+            rows = strtoull(optarg, NULL, 10);
+            if (rows == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            solver = optarg;
+            if (strcmp(solver, "bfs") != 0 && strcmp(solver, "astar") != 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'T':
+            report = true;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (eller && (threads > 0 || solver != NULL)) {
+        fprintf(stderr, "-t and -s apply to the Kruskal generator only, not to -e\n");
+        return 1;
+    }
     
     int maze_size = 6;
-    int actual_size = maze_size * 2 + 1;
     
-    char** maze = malloc(actual_size * sizeof(char*));
-    for (int i = 0; i < actual_size; i++) {
-        maze[i] = malloc(actual_size * sizeof(char));
+    rng_seed(&rng, time(NULL), 0);
+    
+    if (rows == 0) {
+        rows = maze_size;
     }
     
-    init_maze(maze, maze_size);
-    generate_maze(maze, maze_size);
-    print_maze(maze, actual_size);
+    Output* out = open_output(stdout, maze_size, binary, '#', '.');
+    if (out == NULL) {
+        fprintf(stderr, "Cannot allocate the output buffer\n");
+        return 1;
+    }
     
-    for (int i = 0; i < actual_size; i++) {
-        free(maze[i]);
+    if (eller) {
+        if (generate_eller(maze_size, rows, out) != 0) {
+            fprintf(stderr, "Cannot generate a maze %d rooms wide: out of memory\n", maze_size);
+            return 1;
+        }
+    } else {
+        Maze* maze = rows <= INT_MAX ? create_maze(maze_size, rows) : NULL;
+        if (maze == NULL || (threads > 0 ? generate_maze_tiled(maze, threads) : generate_maze(maze)) != 0) {
+            fprintf(stderr, "Cannot generate a %dx%llu maze: out of memory or over 2^32 - 1 rooms\n",
+                    maze_size, (unsigned long long)rows);
+            return 1;
+        }
+        
+        Solution solution = {0};
+        if (solver != NULL) {
+            // Negative values count from the far side; errors quote them as given
+            long given[4];
+            memcpy(given, ends, sizeof(given));
+            for (int i = 0; i < 4; i++) {
+                long limit = i % 2 == 0 ? maze->width : maze->height;
+                if (ends[i] < 0) ends[i] += limit;
+                if (ends[i] < 0 || ends[i] >= limit) {
+                    fprintf(stderr, "Room %ld,%ld is outside the maze\n", given[i & ~1], given[i | 1]);
+                    return 1;
+                }
+            }
+            
+            phase_begin();
+            if (solve_maze(maze, strcmp(solver, "astar") == 0, room_to_index(ends[0], ends[1], maze->width),
+                           room_to_index(ends[2], ends[3], maze->width), &solution) != 0) {
+                fprintf(stderr, "Cannot solve the maze: out of memory\n");
+                return 1;
+            }
+            phase_end(PHASE_SOLVE);
+            fprintf(stderr, "%s: path of %llu rooms, %llu rooms expanded in %.3f s\n", solver,
+                    (unsigned long long)solution.length, (unsigned long long)solution.expanded,
+                    phase_seconds[PHASE_SOLVE]);
+            out->path = solution.path;
+            out->path_mark = '*';
+        }
+        
+        phase_begin();
+        print_maze(maze, out);
+        phase_end(PHASE_OUTPUT);
+        free(solution.path);
+        free_maze(maze);
+    }
+    
+    phase_begin();
+    if (close_output(out) != 0) {
+        perror("Cannot write the maze");
+        return 1;
+    }
+    phase_end(eller ? PHASE_ROWS : PHASE_OUTPUT);
+    
+    if (report) {
+        report_phases(maze_size, rows);
     }
-    free(maze);
     
     return 0;
 }